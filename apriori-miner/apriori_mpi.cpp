@@ -3,16 +3,27 @@
 #include <cstdlib>
 #include <cassert>
 #include <cctype>
+#include <cstdint>
+#include <climits>
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <map>
+#include <deque>
+#include <set>
 #include <algorithm>
 #include <iomanip>
+#include <random>
+#include <cmath>
+#include <type_traits>
+#include <functional>
+#include <iterator>
+#include <cstdio>
 
 #include <unistd.h>
+#include <sys/stat.h>
 #include <mpi.h>
 
 ///////////////////////////////////////////////////////////////////////////////////////////
@@ -82,11 +93,198 @@ struct Params
                 m_MinSup = std::atof(m_ArgV[i + 1]);
                 ++i;
             }
+            else if (strcmp(m_ArgV[i], "--algorithm") == 0 && i + 1 < m_ArgC)
+            {
+                m_Algorithm = m_ArgV[i + 1];
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--sample_fraction") == 0 && i + 1 < m_ArgC)
+            {
+                m_SampleFraction = std::atof(m_ArgV[i + 1]);
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--sample_delta") == 0 && i + 1 < m_ArgC)
+            {
+                m_SampleDelta = std::atof(m_ArgV[i + 1]);
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--sample_seed") == 0 && i + 1 < m_ArgC)
+            {
+                m_SampleSeed = std::atoi(m_ArgV[i + 1]);
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--sample_approx") == 0)
+            {
+                m_SampleApprox = true;
+            }
+            else if (strcmp(m_ArgV[i], "--ranks_per_node") == 0 && i + 1 < m_ArgC)
+            {
+                m_RanksPerNode = std::atoi(m_ArgV[i + 1]);
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--output") == 0 && i + 1 < m_ArgC)
+            {
+                m_OutputDir = m_ArgV[i + 1];
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--output_format") == 0 && i + 1 < m_ArgC)
+            {
+                m_OutputFormat = m_ArgV[i + 1];
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--items") == 0 && i + 1 < m_ArgC)
+            {
+                m_AllowedItems = SplitItems(m_ArgV[i + 1]);
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--exclude") == 0 && i + 1 < m_ArgC)
+            {
+                m_ExcludedItems = SplitItems(m_ArgV[i + 1]);
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--require") == 0 && i + 1 < m_ArgC)
+            {
+                m_RequiredItems = SplitItems(m_ArgV[i + 1]);
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--consequent") == 0 && i + 1 < m_ArgC)
+            {
+                m_ConsequentItems = SplitItems(m_ArgV[i + 1]);
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--min_antecedent") == 0 && i + 1 < m_ArgC)
+            {
+                m_MinAntecedent = std::atoi(m_ArgV[i + 1]);
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--max_antecedent") == 0 && i + 1 < m_ArgC)
+            {
+                m_MaxAntecedent = std::atoi(m_ArgV[i + 1]);
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--compress_counts") == 0)
+            {
+                m_CompressCounts = true;
+            }
+            else if (strcmp(m_ArgV[i], "--stream") == 0 && i + 1 < m_ArgC)
+            {
+                m_StreamFile = m_ArgV[i + 1];
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--batch_size") == 0 && i + 1 < m_ArgC)
+            {
+                m_BatchSize = std::atoi(m_ArgV[i + 1]);
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--window") == 0 && i + 1 < m_ArgC)
+            {
+                m_WindowPanes = std::atoi(m_ArgV[i + 1]);
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--checkpoint") == 0 && i + 1 < m_ArgC)
+            {
+                m_CheckpointDir = m_ArgV[i + 1];
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--resume") == 0)
+            {
+                m_Resume = true;
+            }
+            else if (strcmp(m_ArgV[i], "--append") == 0 && i + 1 < m_ArgC)
+            {
+                m_AppendFile = m_ArgV[i + 1];
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--prev_fsets") == 0 && i + 1 < m_ArgC)
+            {
+                m_PrevFsetsFile = m_ArgV[i + 1];
+                ++i;
+            }
+            else if (strcmp(m_ArgV[i], "--save_fsets") == 0 && i + 1 < m_ArgC)
+            {
+                m_SaveFsetsFile = m_ArgV[i + 1];
+                ++i;
+            }
+        }
+
+        if (m_InputFile.empty() && m_StreamFile.empty())
+        {
+            std::cout << "Usage: --input <file> or --stream <file|->\n";
+            return false;
+        }
+
+        // The window is mined with the default algorithm and nothing is saved between runs
+        if (!m_StreamFile.empty() && (m_BatchSize <= 0 || m_WindowPanes <= 0 || m_Algorithm != "apriori" || m_SampleFraction > 0.f ||
+                                      !m_AppendFile.empty() || !m_SaveFsetsFile.empty() || !m_CheckpointDir.empty()))
+        {
+            std::cout << "Usage: --stream <file|-> --batch_size <n> --window <panes> (only with --algorithm apriori)\n";
+            return false;
+        }
+
+        if (m_Algorithm != "apriori" && m_Algorithm != "son")
+        {
+            std::cout << "Usage: --algorithm <apriori|son>\n";
+            return false;
+        }
+
+        if (m_SampleFraction < 0.f || m_SampleFraction > 1.f || m_SampleDelta <= 0.f || m_SampleDelta >= 1.f)
+        {
+            std::cout << "Usage: --sample_fraction <0..1> --sample_delta <0..1>\n";
+            return false;
+        }
+
+        // The sample is mined with the default algorithm
+        if (m_SampleFraction > 0.f && m_Algorithm != "apriori")
+        {
+            std::cout << "--sample_fraction can't be used with --algorithm son\n";
+            return false;
+        }
+
+        // Sample estimates are neither exact counts nor a complete mining state
+        if (m_SampleApprox && (m_SampleFraction <= 0.f || !m_SaveFsetsFile.empty()))
+        {
+            std::cout << "--sample_approx requires --sample_fraction and can't be used with --save_fsets\n";
+            return false;
+        }
+
+        if (m_OutputFormat != "csv" && m_OutputFormat != "bin")
+        {
+            std::cout << "Usage: --output <dir> --output_format <csv|bin>\n";
+            return false;
+        }
+
+        // Saved itemsets must be complete to be updated incrementally
+        const bool constrained = !m_AllowedItems.empty() || !m_ExcludedItems.empty() ||
+                                 (!m_ConsequentItems.empty() && m_MaxAntecedent > 0);
+        if (!m_SaveFsetsFile.empty() && constrained)
+        {
+            std::cout << "--save_fsets can't be used with --items, --exclude or --consequent with --max_antecedent\n";
+            return false;
+        }
+
+        if (m_Resume && m_CheckpointDir.empty())
+        {
+            std::cout << "Usage: --checkpoint <dir> --resume\n";
+            return false;
+        }
+
+        // Checkpoints are written at the level boundaries of the default algorithm
+        if (!m_CheckpointDir.empty() && (m_Algorithm != "apriori" || m_SampleFraction > 0.f || !m_AppendFile.empty()))
+        {
+            std::cout << "--checkpoint can't be used with --algorithm son, --sample_fraction or --append\n";
+            return false;
+        }
+
+        if (!m_AppendFile.empty() && m_PrevFsetsFile.empty())
+        {
+            std::cout << "Usage: --input <file> --append <file> --prev_fsets <file>\n";
+            return false;
         }
 
-        if (m_InputFile.empty())
+        // Appended transactions are only updated with the default algorithm
+        if (!m_AppendFile.empty() && (m_Algorithm != "apriori" || m_SampleFraction > 0.f))
         {
-            std::cout << "Usage: --input <file>\n";
+            std::cout << "--append can't be used with --algorithm son or --sample_fraction\n";
             return false;
         }
 
@@ -97,19 +295,248 @@ struct Params
     float           m_MinSup = 0.05f;
     float           m_MinConf = 0.8f;
     std::string     m_InputFile;
+    std::string     m_Algorithm = "apriori";
+    float           m_SampleFraction = 0.f; // Mine a sample of the transactions if > 0
+    float           m_SampleDelta = 0.05f;  // Probability of missing frequent itemsets in the sample
+    int             m_SampleSeed = 1;
+    bool            m_SampleApprox = false; // Return sample estimates without verification
+    int             m_RanksPerNode = 0;     // Max processes sharing memory, 0 for all on a node
+    bool            m_CompressCounts = false;
+    std::string     m_AppendFile;       // Transactions appended to the input since prev_fsets
+    std::string     m_PrevFsetsFile;    // Frequent itemsets previously mined from the input
+    std::string     m_SaveFsetsFile;
+    std::string     m_StreamFile;           // Transactions read in batches, - for stdin
+    int             m_BatchSize = 1000;     // Transactions per pane of the stream window
+    int             m_WindowPanes = 4;      // Panes in the stream window
+    std::string     m_CheckpointDir;        // Mining state is saved after each level if set
+    bool            m_Resume = false;       // Resume from the last checkpoint in m_CheckpointDir
+    std::string     m_OutputDir;            // Itemsets and rules are printed if empty
+    std::string     m_OutputFormat = "csv";
+
+    // Constraints (comma separated item names)
+    std::vector<std::string> m_AllowedItems;    // Only these items if not empty
+    std::vector<std::string> m_ExcludedItems;
+    std::vector<std::string> m_RequiredItems;   // Rules must contain all of these
+    std::vector<std::string> m_ConsequentItems; // Rule consequents only of these if not empty
+    int             m_MinAntecedent = 1;
+    int             m_MaxAntecedent = 0;        // No limit if 0
+
+    // Canonical form of the constraints, the same constraints give the same key
+    std::string ConstraintsKey() const
+    {
+        auto join = [](std::vector<std::string> items)
+        {
+            std::sort(items.begin(), items.end());
+            std::string result;
+            for (const auto& item : items)
+                result += item + ',';
+            return result;
+        };
+
+        std::stringstream ss;
+        ss << "items=" << join(m_AllowedItems)
+           << ";exclude=" << join(m_ExcludedItems)
+           << ";require=" << join(m_RequiredItems)
+           << ";consequent=" << join(m_ConsequentItems)
+           << ";min_antecedent=" << m_MinAntecedent
+           << ";max_antecedent=" << m_MaxAntecedent;
+        return ss.str();
+    }
 
     private:
+    static std::vector<std::string> SplitItems(const char* str)
+    {
+        std::vector<std::string> items;
+        std::stringstream ss(str);
+        for (std::string item; std::getline(ss, item, ',');)
+        {
+            item.erase(0, item.find_first_not_of(" \t"));
+            item.erase(item.find_last_not_of(" \t") + 1);
+            if (!item.empty())
+                items.push_back(item);
+        }
+        return items;
+    }
+
     int     m_ArgC = 0;
     char**  m_ArgV = nullptr;
 };
 
+///////////////////////////////////////////////////////////////////////////////////////////
+// Memory allocated by the node leader and mapped by all processes on the node
+struct SharedBuffer
+{
+    SharedBuffer() = default;
+    SharedBuffer(const SharedBuffer&) = delete;
+    SharedBuffer& operator=(const SharedBuffer&) = delete;
+    ~SharedBuffer() { Free(); }
+
+    void Allocate(std::size_t bytes, MPI_Comm nodeComm)
+    {
+        Free();
+        m_NodeComm = nodeComm;
+
+        int nodeRank = 0;
+        MPI_Comm_rank(m_NodeComm, &nodeRank);
+
+        void* base = nullptr;
+        MPI_Aint size = nodeRank == 0 ? std::max<std::size_t>(bytes, 1) : 0;
+        int err = MPI_Win_allocate_shared(size, 1, MPI_INFO_NULL, m_NodeComm, &base, &m_Win);
+        if (err != MPI_SUCCESS)
+        {
+            LOG_ERROR("MPI_Win_allocate_shared failed with err: " << err);
+            exit(1);
+        }
+
+        int dispUnit = 0;
+        MPI_Win_shared_query(m_Win, 0, &size, &dispUnit, &m_Data);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, m_Win);
+        m_Capacity = bytes;
+    }
+
+    // Allocates only if the buffer is smaller than bytes, growing it at least twofold.
+    // All processes on the node must request the same size.
+    void Reserve(std::size_t bytes, MPI_Comm nodeComm)
+    {
+        if (m_Win != MPI_WIN_NULL && bytes <= m_Capacity) return;
+        Allocate(std::max(bytes, 2 * m_Capacity), nodeComm);
+    }
+
+    // Makes the writes of each process visible to all processes on the node
+    void Sync()
+    {
+        MPI_Win_sync(m_Win);
+        MPI_Barrier(m_NodeComm);
+        MPI_Win_sync(m_Win);
+    }
+
+    void Free()
+    {
+        if (m_Win == MPI_WIN_NULL) return;
+        MPI_Win_unlock_all(m_Win);
+        MPI_Win_free(&m_Win);
+        m_Data = nullptr;
+        m_Capacity = 0;
+    }
+
+    template <typename T>
+    T* Data() const { return static_cast<T*>(m_Data); }
+
+    private:
+    MPI_Win m_Win = MPI_WIN_NULL;
+    MPI_Comm m_NodeComm = MPI_COMM_NULL;
+    void* m_Data = nullptr;
+    std::size_t m_Capacity = 0;
+};
+
 ///////////////////////////////////////////////////////////////////////////////////////////
 struct MPIContext
 {
+    bool IsNodeLeader() const { return m_NodeRank == 0; }
+
     int m_Size = 0;
     int m_Rank = 0;
+
+    // Processes on the same node share memory. Only the node leaders (node rank 0)
+    // take part in the collectives between nodes through m_LeaderComm.
+    MPI_Comm m_NodeComm = MPI_COMM_NULL;
+    MPI_Comm m_LeaderComm = MPI_COMM_NULL;
+    int m_NodeSize = 1;
+    int m_NodeRank = 0;
+    int m_NumNodes = 1;
+    int m_NodeId = 0;
+
+    // Counts between nodes are sent in narrow lanes and with encoded ids
+    bool m_CompressCounts = false;
+
+    // Node shared memory of the count reductions, kept across levels
+    mutable SharedBuffer m_CountsBuffer;
 };
 
+void InitMPIContext(MPIContext& ctx, int ranksPerNode)
+{
+    MPI_Comm_size(MPI_COMM_WORLD, &ctx.m_Size);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ctx.m_Rank);
+
+    MPI_Comm sharedComm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, ctx.m_Rank, MPI_INFO_NULL, &sharedComm);
+
+    // Optionally split the node further (e.g. per NUMA domain)
+    int sharedRank = 0;
+    MPI_Comm_rank(sharedComm, &sharedRank);
+    int color = ranksPerNode > 0 ? sharedRank / ranksPerNode : 0;
+    MPI_Comm_split(sharedComm, color, ctx.m_Rank, &ctx.m_NodeComm);
+    MPI_Comm_free(&sharedComm);
+
+    MPI_Comm_size(ctx.m_NodeComm, &ctx.m_NodeSize);
+    MPI_Comm_rank(ctx.m_NodeComm, &ctx.m_NodeRank);
+
+    MPI_Comm_split(MPI_COMM_WORLD, ctx.IsNodeLeader() ? 0 : MPI_UNDEFINED, ctx.m_Rank, &ctx.m_LeaderComm);
+    if (ctx.IsNodeLeader())
+    {
+        MPI_Comm_size(ctx.m_LeaderComm, &ctx.m_NumNodes);
+        MPI_Comm_rank(ctx.m_LeaderComm, &ctx.m_NodeId);
+    }
+
+    MPI_Bcast(&ctx.m_NumNodes, 1, MPI_INT, 0, ctx.m_NodeComm);
+    MPI_Bcast(&ctx.m_NodeId, 1, MPI_INT, 0, ctx.m_NodeComm);
+}
+
+void FreeMPIContext(MPIContext& ctx)
+{
+    ctx.m_CountsBuffer.Free();
+    if (ctx.m_LeaderComm != MPI_COMM_NULL)
+        MPI_Comm_free(&ctx.m_LeaderComm);
+    if (ctx.m_NodeComm != MPI_COMM_NULL)
+        MPI_Comm_free(&ctx.m_NodeComm);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Sums counts of all processes on the node into the counts of the node leader
+void ReduceOnNode(std::vector<int>& counts, const MPIContext& ctx)
+{
+    if (ctx.m_NodeSize == 1) return;
+
+    const std::size_t size = counts.size();
+    SharedBuffer& shared = ctx.m_CountsBuffer;
+    shared.Reserve(size * ctx.m_NodeSize * sizeof(int), ctx.m_NodeComm);
+
+    // The buffer is reused, wait until all processes have read the previous result
+    shared.Sync();
+
+    int* rows = shared.Data<int>();
+    std::copy(counts.begin(), counts.end(), rows + ctx.m_NodeRank * size);
+    shared.Sync();
+
+    if (ctx.IsNodeLeader())
+    {
+        for (int r = 1; r < ctx.m_NodeSize; ++r)
+        {
+            const int* row = rows + r * size;
+            for (std::size_t i = 0; i < size; ++i)
+                counts[i] += row[i];
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Copies the counts of the node leader to all processes on the node.
+// Must follow ReduceOnNode for counts of the same size.
+void BroadcastOnNode(std::vector<int>& counts, const MPIContext& ctx)
+{
+    if (ctx.m_NodeSize == 1) return;
+
+    SharedBuffer& shared = ctx.m_CountsBuffer;
+    int* row = shared.Data<int>();
+    if (ctx.IsNodeLeader())
+        std::copy(counts.begin(), counts.end(), row);
+
+    shared.Sync();
+
+    if (!ctx.IsNodeLeader())
+        std::copy(row, row + counts.size(), counts.begin());
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////
 struct ItemMap
 {
@@ -118,7 +545,18 @@ struct ItemMap
         auto it = m_ItemToId.find(item);
         if (it == m_ItemToId.end())
         {
-            it = m_ItemToId.emplace(item, m_NextId++).first;
+            int id = m_NextId;
+            if (!m_FreeIds.empty())
+            {
+                id = *m_FreeIds.begin();
+                m_FreeIds.erase(m_FreeIds.begin());
+            }
+            else
+            {
+                ++m_NextId;
+            }
+
+            it = m_ItemToId.emplace(item, id).first;
             m_IdToItem.emplace(it->second, item);
         }
         return it->second; 
@@ -130,6 +568,25 @@ struct ItemMap
         return it != m_IdToItem.end() ? &(it->second) : nullptr;
     }
 
+    void Add(int id, const std::string& item)
+    {
+        m_ItemToId[item] = id;
+        m_IdToItem[id] = item;
+        m_NextId = std::max(m_NextId, id + 1);
+        m_FreeIds.erase(id);
+    }
+
+    // The id of a removed item is reused by the next new item
+    void Remove(int id)
+    {
+        auto it = m_IdToItem.find(id);
+        if (it == m_IdToItem.end()) return;
+
+        m_ItemToId.erase(it->second);
+        m_IdToItem.erase(it);
+        m_FreeIds.insert(id);
+    }
+
     bool Empty() const { return m_NextId == 0; }
 
     void Print() const
@@ -145,6 +602,7 @@ struct ItemMap
     int m_NextId = 0;
     std::map<std::string, int> m_ItemToId;
     std::map<int, std::string> m_IdToItem;
+    std::set<int> m_FreeIds; // Ids below m_NextId of removed items
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////
@@ -258,6 +716,8 @@ struct FrequentItemsets
     {
         m_ItemMap.Print();
         std::cout << "\nNum transactions: " << m_NumTrans << '\n';
+        if (m_SupportError > 0.f)
+            std::cout << "Support error: +/- " << std::setprecision(5) << m_SupportError << '\n';
         std::cout << "Itemset counts:\n";
 
         for (const auto& pair : m_KthItemsetCounts)
@@ -270,28 +730,107 @@ struct FrequentItemsets
         }
     }
 
-    bool ToCsv(const std::string& file)
+    // Saves the complete mining state (item ids, exact counts and mining parameters)
+    // so the itemsets can be updated later when new transactions are appended.
+    bool Save(const std::string& file) const
     {
         std::ofstream ofs(file, std::ios::trunc);
         if (!ofs.is_open()) return false;
 
-        ofs << "Itemset, Frequency\n"; // Column Names
+        ofs << "num_trans " << m_NumTrans << '\n';
+        ofs << "checksum " << m_Checksum << '\n';
+        ofs << "min_sup " << std::setprecision(9) << m_MinSup << '\n';
+        ofs << "max_k " << m_MaxK << '\n';
+
+        ofs << "items " << m_ItemMap.m_IdToItem.size() << '\n';
+        for (const auto& pair : m_ItemMap.m_IdToItem)
+        {
+            ofs << pair.first << '\t' << pair.second << '\n';
+        }
+
+        int numItemsets = 0;
+        for (const auto& pair : m_KthItemsetCounts)
+            numItemsets += pair.second.size();
 
+        ofs << "itemsets " << numItemsets << '\n';
         for (const auto& pair : m_KthItemsetCounts)
         {
             for (const auto& itemsetCount : pair.second)
             {
-                ofs << itemsetCount.first.ToString(m_ItemMap, ':') << ", ";
-                ofs << std::setprecision(5) << itemsetCount.second / (float)m_NumTrans << '\n';
+                const auto& items = itemsetCount.first.m_Items;
+                ofs << itemsetCount.second << '\t';
+                for (int i = 0; i < items.size(); ++i)
+                {
+                    ofs << (i > 0 ? "|" : "") << items[i];
+                }
+                ofs << '\n';
             }
         }
-        
+
+        return ofs.good();
+    }
+
+    bool Load(const std::string& file)
+    {
+        std::ifstream ifs(file);
+        if (!ifs.is_open()) return false;
+
+        *this = FrequentItemsets{};
+
+        auto readField = [&](const char* name, auto& value) -> bool
+        {
+            std::string field;
+            return (ifs >> field >> value) && field == name;
+        };
+
+        int numItems = 0;
+        if (!readField("num_trans", m_NumTrans) ||
+            !readField("checksum", m_Checksum) ||
+            !readField("min_sup", m_MinSup) ||
+            !readField("max_k", m_MaxK) ||
+            !readField("items", numItems))
+        {
+            return false;
+        }
+
+        std::string line;
+        std::getline(ifs, line); // Rest of the items line
+        for (int i = 0; i < numItems; ++i)
+        {
+            if (!std::getline(ifs, line)) return false;
+            auto tab = line.find('\t');
+            if (tab == std::string::npos) return false;
+            m_ItemMap.Add(std::stoi(line.substr(0, tab)), line.substr(tab + 1));
+        }
+
+        int numItemsets = 0;
+        if (!readField("itemsets", numItemsets)) return false;
+
+        for (int i = 0; i < numItemsets; ++i)
+        {
+            int count = 0;
+            std::string items;
+            if (!(ifs >> count >> items)) return false;
+
+            Itemset itemset;
+            itemset.FromString(items);
+            m_KthItemsetCounts[itemset.Size()][itemset] = count;
+        }
+
         return true;
     }
 
     ItemMap m_ItemMap;
     std::map<int, ItemsetCounts> m_KthItemsetCounts;
     int m_NumTrans = 0;
+    std::uint64_t m_Checksum = 0; // ChecksumTransactions() of the mined transactions when saved
+
+    // Parameters the itemsets were mined with
+    float m_MinSup = 0.f;
+    int m_MaxK = 0;
+
+    // Bound on the error of the supports when estimated from a sample
+    float m_SupportError = 0.f;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////
@@ -309,494 +848,2721 @@ struct Rule
 
     Itemset m_Antidecent;
     Itemset m_Consequent;
+    float m_Support = 0.f;
     float m_Confidence = 0.f;
     float m_Lift = 0.f;
 };
 using Rules = std::vector<Rule>;
 
 ///////////////////////////////////////////////////////////////////////////////////////////
-using InputData = std::vector<std::vector<std::string>>; // Raw transactions
-using OutputData = std::vector<std::string>;
-
-FrequentItemsets Apriori(const InputData& data, const Params& params, const MPIContext& ctx)
+// Item and rule constraints from Params resolved to item ids.
+// Rules must only contain allowed items and all required items, their consequent
+// must only contain consequent items and their antecedent size must be within bounds.
+struct Constraints
 {
-    FrequentItemsets fsets;
-    fsets.m_NumTrans = data.size();
+    Constraints(const Params& params, const ItemMap& imap)
+        : m_MinAntecedent(params.m_MinAntecedent)
+        , m_MaxAntecedent(params.m_MaxAntecedent)
+    {
+        // Unknown items are never present in transactions
+        auto toIds = [&](const std::vector<std::string>& items, std::vector<int>& outIds)
+        {
+            for (const auto& item : items)
+            {
+                auto it = imap.m_ItemToId.find(item);
+                outIds.push_back(it != imap.m_ItemToId.end() ? it->second : -1);
+            }
+            std::sort(outIds.begin(), outIds.end());
+        };
 
-    std::vector<std::vector<int>> transactions;
+        toIds(params.m_AllowedItems, m_Allowed);
+        toIds(params.m_ExcludedItems, m_Excluded);
+        toIds(params.m_RequiredItems, m_Required);
+        toIds(params.m_ConsequentItems, m_Consequents);
+        m_HasAllowed = !params.m_AllowedItems.empty();
+    }
 
-    // Map input data to transactions
-    for (const auto& row : data)
+    bool IsItemAllowed(int item) const
     {
-        transactions.emplace_back();
-        for (const auto& item : row)
+        if (m_HasAllowed && !std::binary_search(m_Allowed.begin(), m_Allowed.end(), item)) return false;
+        return !std::binary_search(m_Excluded.begin(), m_Excluded.end(), item);
+    }
+
+    // Whether rules can be generated from the itemset
+    bool IsRuleItemset(const Itemset& itemset) const
+    {
+        for (int item : itemset.m_Items)
         {
-            transactions.back().emplace_back(fsets.m_ItemMap.GetOrCreateId(item));
+            if (!IsItemAllowed(item)) return false;
         }
+        return std::includes(itemset.m_Items.begin(), itemset.m_Items.end(), m_Required.begin(), m_Required.end());
     }
 
-    LOG_INFO("Transactions: " << transactions.size());
-
-    ///////////////////////////////////////////////////////////////////////////////////////////
-    auto count = [&](const Itemsets& itemsets, int k) 
+    bool IsConsequentAllowed(const Itemset& consequent) const
     {
-        int first = ctx.m_Rank * fsets.m_NumTrans / ctx.m_Size;
-        int last = (ctx.m_Rank + 1) * fsets.m_NumTrans / ctx.m_Size;
-        auto& counts = fsets.m_KthItemsetCounts[k];
+        if (m_Consequents.empty()) return true;
+        return std::includes(m_Consequents.begin(), m_Consequents.end(), consequent.m_Items.begin(), consequent.m_Items.end());
+    }
 
-        // Init all itemsets with count 0
-        // Note that counts will be later gathered across all processes 
-        // and all itemsets should exist in m_KthItemsetCounts
-        for (const auto& itemset : itemsets)
-            counts[itemset] = 0;
+    // Qualifying rules have consequents of consequent items and antecedents of at most
+    // m_MaxAntecedent items. Only itemsets that can be such a rule, antecedent or
+    // consequent need to be mined.
+    bool HasTrackedSubset() const { return !m_Consequents.empty() && m_MaxAntecedent > 0; }
 
-        for (int i = first; i < last; ++i)
+    bool IsTracked(const Itemset& itemset) const
+    {
+        if (!HasTrackedSubset() || itemset.Size() <= m_MaxAntecedent) return true;
+        for (int item : itemset.m_Items)
         {
-            const auto& t = transactions[i];
-
-            if (t.size() < k) continue; // Transaction cannot contain itemset
-            for (const auto& itemset : itemsets)
+            if (std::binary_search(m_Consequents.begin(), m_Consequents.end(), item)) return true;
+        }
+        return false;
+    }
+
+    std::vector<int> m_Allowed;
+    std::vector<int> m_Excluded;
+    std::vector<int> m_Required;
+    std::vector<int> m_Consequents;
+    bool m_HasAllowed = false;
+    int m_MinAntecedent = 1;
+    int m_MaxAntecedent = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////
+using InputData = std::vector<std::vector<std::string>>; // Raw transactions
+using OutputData = std::vector<std::string>;
+
+///////////////////////////////////////////////////////////////////////////////////////////
+struct TransactionView
+{
+    const int* begin() const { return m_Begin; }
+    const int* end() const { return m_End; }
+    std::size_t Size() const { return m_End - m_Begin; }
+
+    const int* m_Begin = nullptr;
+    const int* m_End = nullptr;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Encoded transactions stored contiguously. After Share() all processes on a node
+// read the single copy of the node leader from shared memory.
+struct Transactions
+{
+    Transactions() { UpdateView(); }
+    Transactions(const Transactions&) = delete;
+    Transactions& operator=(const Transactions&) = delete;
+
+    int Size() const { return m_NumTrans; }
+
+    TransactionView operator[](int i) const
+    {
+        return TransactionView{m_Items + m_Offsets[i], m_Items + m_Offsets[i + 1]};
+    }
+
+    void Add(const int* first, const int* last)
+    {
+        m_LocalItems.insert(m_LocalItems.end(), first, last);
+        m_LocalOffsets.push_back(m_LocalItems.size());
+        UpdateView();
+    }
+
+    void Add(const TransactionView& t) { Add(t.begin(), t.end()); }
+
+    void Share(const MPIContext& ctx)
+    {
+        if (ctx.m_NodeSize == 1) return;
+
+        // Layout: [num trans][offsets (num trans + 1)][items]
+        std::int64_t header[2] = { (std::int64_t)m_LocalOffsets.size(), (std::int64_t)m_LocalItems.size() };
+        MPI_Bcast(header, 2, MPI_INT64_T, 0, ctx.m_NodeComm);
+
+        const std::size_t offsetsBytes = header[0] * sizeof(std::int64_t);
+        m_Shared.Allocate(offsetsBytes + header[1] * sizeof(int), ctx.m_NodeComm);
+
+        auto* offsets = m_Shared.Data<std::int64_t>();
+        auto* items = reinterpret_cast<int*>(m_Shared.Data<char>() + offsetsBytes);
+        if (ctx.IsNodeLeader())
+        {
+            std::copy(m_LocalOffsets.begin(), m_LocalOffsets.end(), offsets);
+            std::copy(m_LocalItems.begin(), m_LocalItems.end(), items);
+        }
+
+        m_Shared.Sync();
+
+        std::vector<std::int64_t>().swap(m_LocalOffsets);
+        std::vector<int>().swap(m_LocalItems);
+
+        m_NumTrans = header[0] - 1;
+        m_Offsets = offsets;
+        m_Items = items;
+    }
+
+    private:
+    void UpdateView()
+    {
+        m_NumTrans = m_LocalOffsets.size() - 1;
+        m_Offsets = m_LocalOffsets.data();
+        m_Items = m_LocalItems.data();
+    }
+
+    int m_NumTrans = 0;
+    const std::int64_t* m_Offsets = nullptr;
+    const int* m_Items = nullptr;
+
+    std::vector<std::int64_t> m_LocalOffsets{0};
+    std::vector<int> m_LocalItems;
+    SharedBuffer m_Shared;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////
+void EncodeTransactions(const InputData& data, ItemMap& imap, Transactions& outTransactions)
+{
+    std::vector<int> transaction;
+    for (const auto& row : data)
+    {
+        transaction.clear();
+        for (const auto& item : row)
+        {
+            transaction.emplace_back(imap.GetOrCreateId(item));
+        }
+        outTransactions.Add(transaction.data(), transaction.data() + transaction.size());
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Splits [begin, end) equally among processes and returns the part of the current rank
+void PartitionRange(int begin, int end, const MPIContext& ctx, int& outFirst, int& outLast)
+{
+    const long long n = end - begin;
+    outFirst = begin + (int)(ctx.m_Rank * n / ctx.m_Size);
+    outLast = begin + (int)((ctx.m_Rank + 1) * n / ctx.m_Size);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+bool IsFrequent(int count, int numTrans, float minSup)
+{
+    if (numTrans == 0) return false;
+    return !(count / (float)numTrans < minSup);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+bool ContainsItemset(const TransactionView& transaction, const Itemset& itemset)
+{
+    for (const auto& item : itemset.m_Items)
+    {
+        if (std::find(transaction.begin(), transaction.end(), item) == transaction.end())
+            return false;
+    }
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// FNV-1a hash of the first numTrans encoded transactions, identifies the input
+// of a checkpoint or of saved itemsets
+std::uint64_t ChecksumTransactions(const Transactions& transactions, int numTrans)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](std::uint32_t value)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            hash ^= (value >> (8 * i)) & 0xff;
+            hash *= 1099511628211ull;
+        }
+    };
+
+    for (int i = 0; i < numTrans; ++i)
+    {
+        const auto t = transactions[i];
+        mix(t.Size());
+        for (int item : t)
+            mix(item);
+    }
+
+    return hash;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Counts the itemsets in transactions [first, last)
+void CountItemsets(const Transactions& transactions, int first, int last, const Itemsets& itemsets, int k, ItemsetCounts& counts)
+{
+    // Init all itemsets with count 0
+    // Note that counts will be later gathered across all processes 
+    // and all itemsets should exist in counts
+    for (const auto& itemset : itemsets)
+        counts[itemset] = 0;
+
+    for (int i = first; i < last; ++i)
+    {
+        const auto t = transactions[i];
+
+        if (t.Size() < k) continue; // Transaction cannot contain itemset
+        for (const auto& itemset : itemsets)
+        {
+            if (ContainsItemset(t, itemset)) 
+                counts[itemset] += 1;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// COMPRESSED COUNTS
+///////////////////////////////////////////////////////////////////////////////////////////
+// Counts exchanged between nodes are mostly small and item ids are dense, so with
+// MPIContext::m_CompressCounts they are sent in narrow lanes and ids are sent as
+// a bitmap or as delta coded varints, whichever is smaller. Candidate counts for
+// k > 1 are sent as a bitmap of the non-zero slots when most of them are zero.
+
+template <typename T>
+void PackLanes(const int* counts, T* outLanes, std::size_t size)
+{
+    for (std::size_t i = 0; i < size; ++i)
+        outLanes[i] = static_cast<T>(counts[i]);
+}
+
+template <typename T>
+void UnpackLanes(const T* lanes, int* outCounts, std::size_t size)
+{
+    for (std::size_t i = 0; i < size; ++i)
+        outCounts[i] = lanes[i];
+}
+
+void AppendVarint(std::vector<std::uint8_t>& buffer, std::uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        buffer.push_back(static_cast<std::uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<std::uint8_t>(value));
+}
+
+std::uint32_t ReadVarint(const std::uint8_t*& data)
+{
+    std::uint32_t value = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        std::uint8_t byte = *data++;
+        value |= std::uint32_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+}
+
+// Number of bytes per lane to hold values up to bound
+int LaneBytes(long long bound)
+{
+    if (bound <= UINT8_MAX) return 1;
+    if (bound <= UINT16_MAX) return 2;
+    return 4;
+}
+
+// Appends the values in lanes of laneBytes bytes
+void AppendLanes(const std::vector<int>& values, int laneBytes, std::vector<std::uint8_t>& outData)
+{
+    std::size_t first = outData.size();
+    outData.resize(first + values.size() * laneBytes);
+    std::uint8_t* lanes = outData.data() + first;
+    switch (laneBytes)
+    {
+        case 1: PackLanes(values.data(), lanes, values.size()); break;
+        case 2:
+        {
+            std::vector<std::uint16_t> packed(values.size());
+            PackLanes(values.data(), packed.data(), values.size());
+            std::memcpy(lanes, packed.data(), packed.size() * sizeof(std::uint16_t));
+            break;
+        }
+        default: std::memcpy(lanes, values.data(), values.size() * sizeof(int)); break;
+    }
+}
+
+// Reads size values from lanes of laneBytes bytes and returns the end of the data
+const std::uint8_t* ReadLanes(const std::uint8_t* data, int laneBytes, std::vector<int>& outValues, std::size_t size)
+{
+    outValues.resize(size);
+    switch (laneBytes)
+    {
+        case 1: UnpackLanes(data, outValues.data(), size); break;
+        case 2:
+        {
+            std::vector<std::uint16_t> packed(size);
+            std::memcpy(packed.data(), data, size * sizeof(std::uint16_t));
+            UnpackLanes(packed.data(), outValues.data(), size);
+            break;
+        }
+        default: std::memcpy(outValues.data(), data, size * sizeof(int)); break;
+    }
+    return data + size * laneBytes;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Encodes the non-zero single item counts as
+// [flags: bit 0 bitmap ids, bits 1-7 lane bytes][varint num counts]
+// [ids: varint num bits + bitmap or delta varints][counts in lanes]
+void EncodeItemCounts(const ItemsetCounts& counts, std::vector<std::uint8_t>& outData)
+{
+    std::vector<int> ids;
+    std::vector<int> values;
+    int maxCount = 0;
+    for (const auto& kvp : counts)
+    {
+        if (kvp.second > 0)
+        {
+            ids.push_back(kvp.first.m_Items.front());
+            values.push_back(kvp.second);
+            maxCount = std::max(maxCount, kvp.second);
+        }
+    }
+
+    std::vector<std::uint8_t> deltas;
+    for (int i = 0, prev = 0; i < ids.size(); ++i)
+    {
+        AppendVarint(deltas, ids[i] - prev);
+        prev = ids[i];
+    }
+
+    const int numBits = ids.empty() ? 0 : ids.back() + 1;
+    const bool bitmap = (numBits + 7) / 8 < deltas.size();
+    const int laneBytes = LaneBytes(maxCount);
+
+    outData.clear();
+    outData.push_back(static_cast<std::uint8_t>((bitmap ? 1 : 0) | (laneBytes << 1)));
+    AppendVarint(outData, ids.size());
+
+    if (bitmap)
+    {
+        AppendVarint(outData, numBits);
+        std::size_t first = outData.size();
+        outData.resize(first + (numBits + 7) / 8, 0);
+        for (int id : ids)
+            outData[first + id / 8] |= std::uint8_t(1u << (id % 8));
+    }
+    else
+    {
+        outData.insert(outData.end(), deltas.begin(), deltas.end());
+    }
+
+    AppendLanes(values, laneBytes, outData);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Adds the counts encoded by EncodeItemCounts to counts and returns the end of the data
+const std::uint8_t* DecodeItemCounts(const std::uint8_t* data, ItemsetCounts& counts)
+{
+    const std::uint8_t flags = *data++;
+    const bool bitmap = flags & 1;
+    const int laneBytes = flags >> 1;
+    const int numCounts = ReadVarint(data);
+
+    std::vector<int> ids;
+    ids.reserve(numCounts);
+    if (bitmap)
+    {
+        const int numBits = ReadVarint(data);
+        for (int id = 0; id < numBits; ++id)
+        {
+            if (data[id / 8] & (1u << (id % 8)))
+                ids.push_back(id);
+        }
+        data += (numBits + 7) / 8;
+    }
+    else
+    {
+        for (int i = 0, prev = 0; i < numCounts; ++i)
+        {
+            prev += ReadVarint(data);
+            ids.push_back(prev);
+        }
+    }
+
+    std::vector<int> values;
+    data = ReadLanes(data, laneBytes, values, numCounts);
+
+    for (int i = 0; i < numCounts; ++i)
+        counts[Itemset(ids[i])] += values[i];
+
+    return data;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Encodes the element-wise counts as [lane bytes][bitmap of the non-zero slots]
+// [non-zero counts in lanes]
+void EncodeSparseCounts(const std::vector<int>& counts, std::vector<std::uint8_t>& outData)
+{
+    std::vector<int> values;
+    int maxCount = 0;
+    for (int count : counts)
+    {
+        if (count > 0)
+        {
+            values.push_back(count);
+            maxCount = std::max(maxCount, count);
+        }
+    }
+
+    const int laneBytes = LaneBytes(maxCount);
+
+    outData.assign(1 + (counts.size() + 7) / 8, 0);
+    outData[0] = static_cast<std::uint8_t>(laneBytes);
+    for (std::size_t i = 0; i < counts.size(); ++i)
+    {
+        if (counts[i] > 0)
+            outData[1 + i / 8] |= std::uint8_t(1u << (i % 8));
+    }
+
+    AppendLanes(values, laneBytes, outData);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Adds the counts encoded by EncodeSparseCounts to counts and returns the end of the data
+const std::uint8_t* DecodeSparseCounts(const std::uint8_t* data, std::vector<int>& counts)
+{
+    const int laneBytes = *data++;
+    const std::uint8_t* bitmap = data;
+    data += (counts.size() + 7) / 8;
+
+    std::size_t numValues = 0;
+    for (std::size_t i = 0; i < counts.size(); ++i)
+    {
+        if (bitmap[i / 8] & (1u << (i % 8)))
+            ++numValues;
+    }
+
+    std::vector<int> values;
+    data = ReadLanes(data, laneBytes, values, numValues);
+
+    for (std::size_t i = 0, v = 0; i < counts.size(); ++i)
+    {
+        if (bitmap[i / 8] & (1u << (i % 8)))
+            counts[i] += values[v++];
+    }
+
+    return data;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+void GatherCompressedItemCountsBetweenNodes(ItemsetCounts& counts, const MPIContext& ctx)
+{
+    std::vector<std::uint8_t> localData;
+    EncodeItemCounts(counts, localData);
+
+    int localDataSize = localData.size();
+    std::vector<int> dataSizeForRank(ctx.m_NumNodes);
+    MPI_Allgather(&localDataSize, 1, MPI_INT, dataSizeForRank.data(), 1, MPI_INT, ctx.m_LeaderComm);
+
+    std::vector<int> dataOffsets;
+    dataOffsets.reserve(ctx.m_NumNodes);
+    int globalDataSize = 0;
+    for (int size : dataSizeForRank)
+    {
+        dataOffsets.push_back(globalDataSize);
+        globalDataSize += size;
+    }
+
+    std::vector<std::uint8_t> globalData(globalDataSize);
+    int err = MPI_Allgatherv(
+        localData.data(),
+        localDataSize,
+        MPI_BYTE,
+        globalData.data(),
+        dataSizeForRank.data(),
+        dataOffsets.data(),
+        MPI_BYTE,
+        ctx.m_LeaderComm);
+
+    if (err != MPI_SUCCESS)
+    {
+        LOG_ERROR("MPI_Allgatherv failed with err: " << err);
+        exit(1);
+    }
+
+    LOG_DEBUG("Compressed k=1 counts: " << globalDataSize << " bytes");
+
+    counts.clear();
+    for (int node = 0; node < ctx.m_NumNodes; ++node)
+        DecodeItemCounts(globalData.data() + dataOffsets[node], counts);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Sums single item counts across the node leaders. Only non-zero counts are exchanged
+// so items missing from the result have a global count of 0.
+void GatherItemCountsBetweenNodes(ItemsetCounts& counts, const MPIContext& ctx)
+{
+    if (ctx.m_CompressCounts)
+    {
+        GatherCompressedItemCountsBetweenNodes(counts, ctx);
+        return;
+    }
+
+    std::vector<int> localCountsDataSizeForRank(ctx.m_NumNodes);
+    std::vector<int> countOffsets;
+    countOffsets.reserve(ctx.m_NumNodes);
+    
+    // Sum the number of non-zero counts we will be sending
+    int localCountsDataSize = 0;
+    for (const auto& kvp : counts)
+    {
+        if (kvp.second > 0) ++localCountsDataSize;
+    }
+
+    // Each count is a pair of an item id and count
+    localCountsDataSize = localCountsDataSize * 2;
+
+    int err = MPI_SUCCESS;
+
+    // Exchange local counts data sizes 
+    // to calculate the global counts data size
+    err = MPI_Allgather(
+        &localCountsDataSize,
+        1,
+        MPI_INT,
+        localCountsDataSizeForRank.data(),
+        1,
+        MPI_INT,
+        ctx.m_LeaderComm);
+
+    if (err != MPI_SUCCESS)
+    {
+        LOG_ERROR("MPI_Allgather failed with err: " << err);
+        exit(1);
+    }
+
+    // Create offsets from running sum of global counts size
+    int globalCountsDataSize = 0;
+    for (int size : localCountsDataSizeForRank)
+    {
+        countOffsets.push_back(globalCountsDataSize);
+        globalCountsDataSize += size;
+    }
+
+    // Gather counts data
+    std::vector<int> localCountsData;
+    localCountsData.reserve(localCountsDataSize);
+
+    LOG_DEBUG("Local counts data:");
+    for (const auto& kvp : counts)
+    {
+        if (kvp.second > 0)
+        {
+            localCountsData.push_back(kvp.first.m_Items.front());
+            localCountsData.push_back(kvp.second);
+
+            LOG_DEBUG(kvp.first.ToString() << ": " << kvp.second);
+        }
+    }
+
+    std::vector<int> globalCountsData(globalCountsDataSize);
+
+    err = MPI_Allgatherv(
+        localCountsData.data(),
+        localCountsData.size(),
+        MPI_INT,
+        globalCountsData.data(),
+        localCountsDataSizeForRank.data(),
+        countOffsets.data(),
+        MPI_INT,
+        ctx.m_LeaderComm);
+
+    if (err != MPI_SUCCESS)
+    {
+        LOG_ERROR("MPI_Allgatherv failed with err: " << err);
+        exit(1);
+    }
+
+    // Merge counts from all processes into local data
+    counts.clear();
+    for (int i = 1; i < globalCountsDataSize; i+=2)
+    {
+        counts[Itemset(globalCountsData[i-1])] += globalCountsData[i];
+    }
+
+    LOG_DEBUG("Global counts data for k=1:");
+    for (const auto& kvp : counts)
+    {
+        LOG_DEBUG(kvp.first.ToString() << ": " << kvp.second);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Sums counts element-wise across the node leaders, sent in lanes of type T
+template <typename T>
+void ReduceLanesBetweenNodes(std::vector<int>& counts, MPI_Datatype type, const MPIContext& ctx)
+{
+    // Reduce scatter
+    const int size = counts.size();
+    const int size_part = size / ctx.m_NumNodes;
+    std::vector<int> sizes(ctx.m_NumNodes, size_part);
+    
+    // Distribute remainder
+    for (int i = 0; i < size % ctx.m_NumNodes; ++i) 
+        sizes[i] += 1;
+
+    std::vector<T> packed;
+    T* lanes = nullptr;
+    if constexpr (std::is_same<T, int>::value)
+    {
+        lanes = counts.data();
+    }
+    else
+    {
+        packed.resize(size);
+        PackLanes(counts.data(), packed.data(), size);
+        lanes = packed.data();
+    }
+
+    std::vector<T> globalCountsForRank(sizes[ctx.m_NodeId]);
+
+    LOG_DEBUG("MPI_Reduce_scatter start");
+    LOG_DEBUG("counts size =" << size);
+    LOG_DEBUG("size part = " << size_part);
+    MPI_Reduce_scatter(
+        lanes, /*sendbuf*/
+        globalCountsForRank.data(), /*recvbuf*/
+        sizes.data(), /*recvcounts*/
+        type,
+        MPI_SUM,
+        ctx.m_LeaderComm
+    );
+    LOG_DEBUG("MPI_Reduce_scatter end");
+
+    // All gather
+    std::vector<int> globalCountsOffsets;
+
+    int offsetSum = 0;
+    for (const auto& size : sizes)
+    {
+        globalCountsOffsets.push_back(offsetSum);
+        offsetSum += size;
+    }
+
+    LOG_DEBUG("MPI_Allgatherv start");
+    MPI_Allgatherv(
+        globalCountsForRank.data(), /*sendbuf*/
+        globalCountsForRank.size(), /*sendcount*/
+        type,
+        lanes, /*recvbuf*/
+        sizes.data(), /*recvcounts*/
+        globalCountsOffsets.data(), /*displacements*/
+        type,
+        ctx.m_LeaderComm
+    );
+    LOG_DEBUG("MPI_Allgatherv end");
+
+    if constexpr (!std::is_same<T, int>::value)
+        UnpackLanes(lanes, counts.data(), size);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Sums counts element-wise across the node leaders
+void ReduceCountsBetweenNodes(std::vector<int>& counts, const MPIContext& ctx)
+{
+    if (!ctx.m_CompressCounts || ctx.m_NumNodes == 1)
+    {
+        ReduceLanesBetweenNodes<int>(counts, MPI_INT, ctx);
+        return;
+    }
+
+    std::vector<std::uint8_t> localData;
+    EncodeSparseCounts(counts, localData);
+
+    // Exchange [sparse data size, maximum count] of all nodes
+    long long localInfo[2] = { (long long)localData.size(),
+                               counts.empty() ? 0 : *std::max_element(counts.begin(), counts.end()) };
+    std::vector<long long> infoForNode(2 * ctx.m_NumNodes);
+    MPI_Allgather(localInfo, 2, MPI_LONG_LONG, infoForNode.data(), 2, MPI_LONG_LONG, ctx.m_LeaderComm);
+
+    // The sum of the maximum counts of all nodes bounds every summed count
+    long long sparseDataSize = 0;
+    long long bound = 0;
+    for (int node = 0; node < ctx.m_NumNodes; ++node)
+    {
+        sparseDataSize += infoForNode[2 * node];
+        bound += infoForNode[2 * node + 1];
+    }
+
+    const int laneBytes = LaneBytes(bound);
+
+    // Reduce scatter and all gather move about twice the dense lanes per node
+    if (sparseDataSize < 2LL * counts.size() * laneBytes && sparseDataSize <= INT_MAX)
+    {
+        LOG_DEBUG("Gathering " << counts.size() << " sparse counts in " << sparseDataSize << " bytes");
+
+        std::vector<int> dataSizeForNode(ctx.m_NumNodes);
+        std::vector<int> dataOffsets(ctx.m_NumNodes);
+        for (int node = 0, offset = 0; node < ctx.m_NumNodes; ++node)
+        {
+            dataSizeForNode[node] = infoForNode[2 * node];
+            dataOffsets[node] = offset;
+            offset += dataSizeForNode[node];
+        }
+
+        std::vector<std::uint8_t> globalData(sparseDataSize);
+        int err = MPI_Allgatherv(
+            localData.data(),
+            localData.size(),
+            MPI_BYTE,
+            globalData.data(),
+            dataSizeForNode.data(),
+            dataOffsets.data(),
+            MPI_BYTE,
+            ctx.m_LeaderComm);
+
+        if (err != MPI_SUCCESS)
+        {
+            LOG_ERROR("MPI_Allgatherv failed with err: " << err);
+            exit(1);
+        }
+
+        std::fill(counts.begin(), counts.end(), 0);
+        for (int node = 0; node < ctx.m_NumNodes; ++node)
+            DecodeSparseCounts(globalData.data() + dataOffsets[node], counts);
+        return;
+    }
+
+    LOG_DEBUG("Reducing " << counts.size() << " counts in " << laneBytes * 8 << " bit lanes");
+
+    switch (laneBytes)
+    {
+        case 1: ReduceLanesBetweenNodes<std::uint8_t>(counts, MPI_UINT8_T, ctx); break;
+        case 2: ReduceLanesBetweenNodes<std::uint16_t>(counts, MPI_UINT16_T, ctx); break;
+        default: ReduceLanesBetweenNodes<int>(counts, MPI_INT, ctx); break;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Sums single item counts across all processes. Counts are first summed on each node
+// in shared memory, then only the node leaders exchange them.
+void GatherItemCounts(ItemsetCounts& counts, const MPIContext& ctx)
+{
+    LOG_DEBUG("Gather K=1 ...");
+
+    // All processes hold the same items
+    Itemsets items;
+    std::vector<int> nodeCounts;
+
+    if (ctx.m_NodeSize > 1)
+    {
+        items.reserve(counts.size());
+        nodeCounts.reserve(counts.size());
+        for (const auto& kvp : counts)
+        {
+            items.push_back(kvp.first);
+            nodeCounts.push_back(kvp.second);
+        }
+
+        ReduceOnNode(nodeCounts, ctx);
+
+        int i = 0;
+        for (auto& kvp : counts)
+            kvp.second = nodeCounts[i++];
+    }
+
+    if (ctx.IsNodeLeader())
+        GatherItemCountsBetweenNodes(counts, ctx);
+
+    if (ctx.m_NodeSize > 1)
+    {
+        for (int i = 0; i < items.size(); ++i)
+        {
+            auto it = counts.find(items[i]);
+            nodeCounts[i] = it != counts.end() ? it->second : 0;
+        }
+
+        BroadcastOnNode(nodeCounts, ctx);
+
+        counts.clear();
+        for (int i = 0; i < items.size(); ++i)
+        {
+            if (nodeCounts[i] > 0)
+                counts[items[i]] = nodeCounts[i];
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Sums counts element-wise across all processes. Counts are first summed on each node
+// in shared memory, then only the node leaders exchange them.
+// All processes must pass counts of the same size.
+void ReduceCounts(std::vector<int>& counts, const MPIContext& ctx)
+{
+    ReduceOnNode(counts, ctx);
+
+    if (ctx.IsNodeLeader())
+        ReduceCountsBetweenNodes(counts, ctx);
+
+    BroadcastOnNode(counts, ctx);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Sums itemset counts across all processes.
+// All processes must hold the same itemsets in counts.
+void GatherItemsetCounts(ItemsetCounts& counts, const MPIContext& ctx)
+{
+    std::vector<int> globalCounts;
+    globalCounts.reserve(counts.size());
+
+    for (const auto& kvp : counts)
+        globalCounts.push_back(kvp.second);
+
+    ReduceCounts(globalCounts, ctx);
+
+    // Update final counts assuming dict is ordered
+    int i = 0;
+    for (auto it = counts.begin(); it != counts.end(); ++it, ++i)
+    {
+        it->second = globalCounts[i];
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Removes the infrequent itemsets from counts and returns the frequent ones
+Itemsets PruneItemsets(const Itemsets& itemsets, ItemsetCounts& counts, int numTrans, float minSup)
+{
+    Itemsets result;
+    for (const auto& itemset : itemsets)
+    {
+        if (counts[itemset] / (float)numTrans < minSup)
+        {
+            counts.erase(itemset);
+        }
+        else
+        {
+            result.push_back(itemset);
+        }
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Joins the frequent (k-1)-itemsets into k-itemset candidates whose
+// (k-1) subsets are all present in prevCounts
+Itemsets GenerateCandidates(const Itemsets& itemsets, const ItemsetCounts& prevCounts)
+{
+    Itemsets result;
+
+    auto same_prefix = [](const Itemset& lhs, const Itemset& rhs)
+    {
+        if (lhs.m_Items.size() != rhs.m_Items.size()) return false;
+        for (int i = 0; i < lhs.m_Items.size() - 1; ++i)
+        {
+            if (lhs.m_Items[i] != rhs.m_Items[i]) return false; // Mismatch
+        }
+        return true; // Same (size - 1) prefix
+    };
+
+    for (int i = 0; i < itemsets.size(); ++i)
+    {
+        const auto& lhs = itemsets[i];
+
+        for (int j = i+1; j < itemsets.size(); ++j)
+        {    
+            const auto& rhs = itemsets[j];
+
+            // Require same prefix
+            if (!same_prefix(lhs, rhs)) break;
+
+            // Create new itemset (lhs + last element of rhs)
+            Itemset itemset = lhs;
+            itemset.m_Items.push_back(rhs.m_Items.back());
+
+            // Check if all k-1 subsets are frequent
+            bool valid = true;
+            for (const auto& subset : itemset.Subsets())
+            {
+                if (prevCounts.find(subset) == prevCounts.end())
+                {
+                    valid = false;
+                    break;
+                }
+            }
+
+            if (valid) 
+                result.emplace_back(std::move(itemset));
+        }
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Extends the tracked (k-1)-itemsets by one frequent item into k-itemset candidates
+// whose tracked (k-1) subsets are all present in prevCounts. Used instead of the prefix
+// join when only the itemsets tracked by the constraints are mined, as a tracked
+// candidate may have untracked (k-1) prefixes.
+Itemsets GenerateTrackedCandidates(const Itemsets& itemsets, const Itemsets& items, const ItemsetCounts& prevCounts, const Constraints& constraints)
+{
+    std::set<Itemset> result;
+
+    for (const auto& itemset : itemsets)
+    {
+        for (const auto& item : items)
+        {
+            const int id = item.m_Items.front();
+            auto pos = std::lower_bound(itemset.m_Items.begin(), itemset.m_Items.end(), id);
+            if (pos != itemset.m_Items.end() && *pos == id) continue;
+
+            Itemset candidate;
+            candidate.m_Items.reserve(itemset.Size() + 1);
+            candidate.m_Items.assign(itemset.m_Items.begin(), pos);
+            candidate.m_Items.push_back(id);
+            candidate.m_Items.insert(candidate.m_Items.end(), pos, itemset.m_Items.end());
+
+            if (!constraints.IsTracked(candidate) || result.count(candidate) > 0) continue;
+
+            bool valid = true;
+            for (const auto& subset : candidate.Subsets())
+            {
+                if (constraints.IsTracked(subset) && prevCounts.find(subset) == prevCounts.end())
+                {
+                    valid = false;
+                    break;
+                }
+            }
+
+            if (valid)
+                result.insert(std::move(candidate));
+        }
+    }
+
+    return Itemsets(result.begin(), result.end());
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Level-wise mining of the transactions [first, last) out of numTrans transactions.
+// Counts are summed across all processes unless ctx is null, in which case the
+// transactions are mined locally without any communication.
+// The infrequent candidates (the negative border) are appended to outBorder if given.
+// If outKthCounts already holds mined levels, mining resumes after the last of them.
+// onLevel is called with k after the itemsets of level k are pruned.
+void MineLevels(const Transactions& transactions, int first, int last, int numTrans, float minSup, int maxK,
+                const ItemMap& imap, const Constraints& constraints, const MPIContext* ctx,
+                std::map<int, ItemsetCounts>& outKthCounts, Itemsets* outBorder = nullptr,
+                const std::function<void(int)>& onLevel = nullptr)
+{
+    Itemsets L1;
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    auto prune = [&](const std::vector<Itemset>& itemsets, int k)
+    {
+        auto& counts = outKthCounts[k];
+        Itemsets result = PruneItemsets(itemsets, counts, numTrans, minSup);
+
+        if (outBorder)
+        {
+            for (const auto& itemset : itemsets)
+                if (counts.find(itemset) == counts.end())
+                    outBorder->push_back(itemset);
+        }
+
+        return result;
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    auto gen_L1 = [&]() -> Itemsets
+    {
+        LOG_DEBUG("Generating L=1 ...");
+        
+        std::vector<Itemset> c1;
+        c1.reserve(imap.m_ItemToId.size());
+        for (const auto& pair: imap.m_IdToItem) 
+        {
+            if (constraints.IsItemAllowed(pair.first))
+                c1.emplace_back(pair.first);
+        }
+
+        CountItemsets(transactions, first, last, c1, 1, outKthCounts[1]);
+        if (ctx)
+            GatherItemCounts(outKthCounts[1], *ctx);
+        L1 = prune(c1, 1);
+        if (onLevel) onLevel(1);
+        return L1;
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    auto gen_Lk = [&](const Itemsets& itemsets, int k) -> Itemsets
+    {
+        LOG_DEBUG("Generating L=" << k << "...");
+        if (constraints.HasTrackedSubset())
+            return GenerateTrackedCandidates(itemsets, L1, outKthCounts[k-1], constraints);
+        return GenerateCandidates(itemsets, outKthCounts[k-1]); // Counts for k-1 subsets
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    int k = 2;
+    Itemsets L;
+
+    if (outKthCounts.empty())
+    {
+        L = gen_L1();
+    }
+    else
+    {
+        for (const auto& kvp : outKthCounts[1])
+            L1.push_back(kvp.first);
+
+        k = outKthCounts.rbegin()->first;
+        for (const auto& kvp : outKthCounts[k])
+            L.push_back(kvp.first);
+        ++k;
+
+        LOG_INFO("Resuming from k=" << k);
+    }
+
+    while (L.size() > 0)
+    {
+        if (maxK > 0 && k > maxK) break;
+        Itemsets C = gen_Lk(L, k);
+        CountItemsets(transactions, first, last, C, k, outKthCounts[k]);
+        LOG_DEBUG("k=" << k << " candidate itemsets:");
+        for (const auto& itemset : C)
+            LOG_DEBUG(itemset.ToString());
+
+        if (ctx)
+        {
+            LOG_DEBUG("Gather k=" << k << " ...");
+            GatherItemsetCounts(outKthCounts[k], *ctx);
+        }
+        L = prune(C, k);
+        if (onLevel) onLevel(k);
+
+        LOG_DEBUG("k=" << k << " pruned itemsets:");
+        for (const auto& itemset : L)
+            LOG_DEBUG(itemset.ToString());
+        
+        ++k;
+    }
+
+    LOG_DEBUG("Done building frequent itemsets. k=" << k << " max_k=" << maxK);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Mining state of a checkpoint and the input it was mined from
+struct Checkpoint
+{
+    FrequentItemsets    m_Fsets;
+    int                 m_Level = 0;
+    std::uint64_t       m_Checksum = 0;     // ChecksumTransactions() of the input
+    std::string         m_Constraints;      // Params::ConstraintsKey()
+};
+
+bool WriteCheckpoint(const std::string& dir, const FrequentItemsets& fsets, int level, std::uint64_t checksum,
+                     const Params& params, const MPIContext& ctx);
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Mining resumes from the levels of checkpoint if given and it was made with the same
+// transactions, parameters and constraints.
+FrequentItemsets Apriori(const Transactions& transactions, const ItemMap& imap, const Params& params, const MPIContext& ctx,
+                         const Checkpoint* checkpoint = nullptr)
+{
+    FrequentItemsets fsets;
+    fsets.m_ItemMap = imap;
+    fsets.m_NumTrans = transactions.Size();
+    fsets.m_MinSup = params.m_MinSup;
+    fsets.m_MaxK = params.m_MaxK;
+
+    LOG_INFO("Transactions: " << transactions.Size());
+
+    const std::uint64_t checksum = params.m_CheckpointDir.empty() ? 0 : ChecksumTransactions(transactions, transactions.Size());
+
+    if (checkpoint)
+    {
+        const auto& prev = checkpoint->m_Fsets;
+        if (checkpoint->m_Checksum != checksum || prev.m_NumTrans != fsets.m_NumTrans ||
+            prev.m_MinSup != fsets.m_MinSup || prev.m_MaxK != fsets.m_MaxK)
+        {
+            LOG_WARN("Checkpoint was made with different transactions or parameters! Mining from scratch.");
+        }
+        else if (checkpoint->m_Constraints != params.ConstraintsKey())
+        {
+            LOG_WARN("Checkpoint was made with different constraints! Mining from scratch.");
+        }
+        else
+        {
+            fsets.m_KthItemsetCounts = prev.m_KthItemsetCounts;
+        }
+    }
+
+    int first = 0;
+    int last = 0;
+    PartitionRange(0, fsets.m_NumTrans, ctx, first, last);
+
+    std::function<void(int)> onLevel;
+    if (!params.m_CheckpointDir.empty())
+    {
+        onLevel = [&](int k)
+        {
+            if (!WriteCheckpoint(params.m_CheckpointDir, fsets, k, checksum, params, ctx))
+                LOG_ERROR("Failed to write checkpoint! k=" << k);
+        };
+    }
+
+    MineLevels(transactions, first, last, fsets.m_NumTrans, params.m_MinSup, params.m_MaxK,
+               fsets.m_ItemMap, Constraints(params, imap), &ctx, fsets.m_KthItemsetCounts, nullptr, onLevel);
+
+    return fsets;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Fast update of frequent itemsets (FUP) after transactions are appended to the data
+// which prev was mined from. Itemsets frequent in prev are only counted in the new
+// transactions. Other candidates can only become frequent if they are frequent in the
+// new transactions alone, so only those are counted in the old transactions.
+// The first numOld transactions are the old ones and the rest are the new ones.
+// The result is the same as mining all transactions from scratch.
+FrequentItemsets IncrementalApriori(const FrequentItemsets& prev, const Transactions& transactions, int numOld, const ItemMap& imap, const Params& params, const MPIContext& ctx)
+{
+    FrequentItemsets fsets;
+    fsets.m_ItemMap = imap;
+    fsets.m_MinSup = params.m_MinSup;
+    fsets.m_MaxK = params.m_MaxK;
+    fsets.m_NumTrans = transactions.Size();
+
+    const int numNew = fsets.m_NumTrans - numOld;
+
+    LOG_INFO("Transactions: " << numOld << " old + " << numNew << " new");
+
+    int oldFirst = 0, oldLast = 0;
+    int newFirst = 0, newLast = 0;
+    PartitionRange(0, numOld, ctx, oldFirst, oldLast);
+    PartitionRange(numOld, fsets.m_NumTrans, ctx, newFirst, newLast);
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    auto update = [&](const Itemsets& candidates, int k) -> Itemsets
+    {
+        // Count all candidates in the new transactions
+        ItemsetCounts newCounts;
+        CountItemsets(transactions, newFirst, newLast, candidates, k, newCounts);
+        if (k == 1)
+            GatherItemCounts(newCounts, ctx);
+        else
+            GatherItemsetCounts(newCounts, ctx);
+
+        static const ItemsetCounts s_empty;
+        auto itPrev = prev.m_KthItemsetCounts.find(k);
+        const auto& prevCounts = itPrev != prev.m_KthItemsetCounts.end() ? itPrev->second : s_empty;
+
+        auto& counts = fsets.m_KthItemsetCounts[k];
+        Itemsets rescan;
+
+        for (const auto& itemset : candidates)
+        {
+            auto itNew = newCounts.find(itemset);
+            int newCount = itNew != newCounts.end() ? itNew->second : 0;
+
+            auto itOld = prevCounts.find(itemset);
+            if (itOld != prevCounts.end())
+                counts[itemset] = itOld->second + newCount;
+            else if (IsFrequent(newCount, numNew, params.m_MinSup))
+                rescan.push_back(itemset);
+        }
+
+        LOG_DEBUG("k=" << k << " candidates=" << candidates.size() << " rescan=" << rescan.size());
+
+        // Only the rescan candidates need a pass over the old transactions
+        if (!rescan.empty())
+        {
+            ItemsetCounts oldCounts;
+            CountItemsets(transactions, oldFirst, oldLast, rescan, k, oldCounts);
+            GatherItemsetCounts(oldCounts, ctx);
+
+            for (const auto& kvp : oldCounts)
+                counts[kvp.first] = kvp.second + newCounts[kvp.first];
+        }
+
+        return PruneItemsets(candidates, counts, fsets.m_NumTrans, params.m_MinSup);
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    // Candidates are generated as in MineLevels so the constraints give the same result
+    const Constraints constraints(params, imap);
+
+    Itemsets c1;
+    c1.reserve(fsets.m_ItemMap.m_IdToItem.size());
+    for (const auto& pair: fsets.m_ItemMap.m_IdToItem) 
+    {
+        if (constraints.IsItemAllowed(pair.first))
+            c1.emplace_back(pair.first);
+    }
+
+    int k = 2;
+    const Itemsets L1 = update(c1, 1);
+    Itemsets L = L1;
+
+    while (L.size() > 0)
+    {
+        if (params.m_MaxK > 0 && k > params.m_MaxK) break;
+        Itemsets C = constraints.HasTrackedSubset() ? GenerateTrackedCandidates(L, L1, fsets.m_KthItemsetCounts[k-1], constraints)
+                                                    : GenerateCandidates(L, fsets.m_KthItemsetCounts[k-1]);
+        L = update(C, k);
+
+        LOG_DEBUG("k=" << k << " updated itemsets:");
+        for (const auto& itemset : L)
+            LOG_DEBUG(itemset.ToString());
+
+        ++k;
+    }
+
+    LOG_DEBUG("Done updating frequent itemsets. k=" << k << " max_k=" << params.m_MaxK);
+
+    return fsets;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Counts the itemsets of all levels in one pass over transactions [first, last)
+// and sums them across all processes with one reduction
+void CountAllLevels(const Transactions& transactions, int first, int last, std::map<int, ItemsetCounts>& kthCounts, const MPIContext& ctx)
+{
+    for (int i = first; i < last; ++i)
+    {
+        const auto t = transactions[i];
+        for (auto& pair : kthCounts)
+        {
+            if (t.Size() < pair.first) break; // Transaction cannot contain larger itemsets
+            for (auto& kvp : pair.second)
+            {
+                if (ContainsItemset(t, kvp.first))
+                    kvp.second += 1;
+            }
+        }
+    }
+
+    std::vector<int> globalCounts;
+    for (const auto& pair : kthCounts)
+        for (const auto& kvp : pair.second)
+            globalCounts.push_back(kvp.second);
+
+    ReduceCounts(globalCounts, ctx);
+
+    int i = 0;
+    for (auto& pair : kthCounts)
+        for (auto& kvp : pair.second)
+            kvp.second = globalCounts[i++];
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Removes the infrequent itemsets of all levels and the levels left empty
+void PruneAllLevels(std::map<int, ItemsetCounts>& kthCounts, int numTrans, float minSup)
+{
+    for (auto& pair : kthCounts)
+    {
+        for (auto it = pair.second.begin(); it != pair.second.end();)
+        {
+            if (it->second / (float)numTrans < minSup)
+                it = pair.second.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    while (kthCounts.size() > 1 && kthCounts.rbegin()->second.empty())
+        kthCounts.erase(std::prev(kthCounts.end()));
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Serializes the itemsets of all levels as [k, item_1, ..., item_k]...
+std::vector<int> SerializeItemsets(const std::map<int, ItemsetCounts>& kthCounts)
+{
+    std::vector<int> data;
+    for (const auto& pair : kthCounts)
+    {
+        for (const auto& kvp : pair.second)
+        {
+            data.push_back(pair.first);
+            data.insert(data.end(), kvp.first.m_Items.begin(), kvp.first.m_Items.end());
+        }
+    }
+
+    return data;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Adds the serialized itemsets to kthCounts, itemsets already present are kept
+void DeserializeItemsets(const std::vector<int>& data, std::map<int, ItemsetCounts>& kthCounts)
+{
+    for (int i = 0; i < data.size();)
+    {
+        int k = data[i++];
+        Itemset itemset;
+        itemset.m_Items.assign(data.begin() + i, data.begin() + i + k);
+        kthCounts[k].emplace(std::move(itemset), 0);
+        i += k;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Concatenates the data of all processes of comm in rank order. With toAll every
+// process receives the result, otherwise only rank 0 of comm.
+std::vector<int> GatherData(const std::vector<int>& localData, MPI_Comm comm, bool toAll)
+{
+    int commSize = 0;
+    MPI_Comm_size(comm, &commSize);
+
+    int localDataSize = localData.size();
+    std::vector<int> dataSizeForRank(commSize);
+    if (toAll)
+        MPI_Allgather(&localDataSize, 1, MPI_INT, dataSizeForRank.data(), 1, MPI_INT, comm);
+    else
+        MPI_Gather(&localDataSize, 1, MPI_INT, dataSizeForRank.data(), 1, MPI_INT, 0, comm);
+
+    std::vector<int> dataOffsets;
+    dataOffsets.reserve(commSize);
+    int globalDataSize = 0;
+    for (int size : dataSizeForRank)
+    {
+        dataOffsets.push_back(globalDataSize);
+        globalDataSize += size;
+    }
+
+    std::vector<int> globalData(globalDataSize);
+    int err = toAll ? MPI_Allgatherv(localData.data(), localDataSize, MPI_INT, globalData.data(),
+                                     dataSizeForRank.data(), dataOffsets.data(), MPI_INT, comm)
+                    : MPI_Gatherv(localData.data(), localDataSize, MPI_INT, globalData.data(),
+                                  dataSizeForRank.data(), dataOffsets.data(), MPI_INT, 0, comm);
+
+    if (err != MPI_SUCCESS)
+    {
+        LOG_ERROR((toAll ? "MPI_Allgatherv" : "MPI_Gatherv") << " failed with err: " << err);
+        exit(1);
+    }
+
+    return globalData;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Two phase partition mining (SON). Every globally frequent itemset is frequent in at
+// least one partition, so the union of the locally frequent itemsets of all processes
+// is a complete set of candidates. Phase one mines each partition locally and exchanges
+// the candidates. Phase two counts all candidates in one pass and one reduction.
+FrequentItemsets SonApriori(const Transactions& transactions, const ItemMap& imap, const Params& params, const MPIContext& ctx)
+{
+    FrequentItemsets fsets;
+    fsets.m_ItemMap = imap;
+    fsets.m_NumTrans = transactions.Size();
+    fsets.m_MinSup = params.m_MinSup;
+    fsets.m_MaxK = params.m_MaxK;
+
+    LOG_INFO("Transactions: " << transactions.Size());
+
+    int first = 0;
+    int last = 0;
+    PartitionRange(0, fsets.m_NumTrans, ctx, first, last);
+
+    // Phase one: local candidates
+    LOG_DEBUG("SON phase one ...");
+    std::map<int, ItemsetCounts> localCounts;
+    if (last > first)
+    {
+        MineLevels(transactions, first, last, last - first, params.m_MinSup, params.m_MaxK,
+                   fsets.m_ItemMap, Constraints(params, imap), nullptr, localCounts);
+    }
+
+    // Union of candidates, ordered the same way on all processes. The candidates are
+    // merged on each node first so only one set per node is exchanged between nodes.
+    auto& kthCounts = fsets.m_KthItemsetCounts;
+    std::vector<int> data = GatherData(SerializeItemsets(localCounts), ctx.m_NodeComm, false);
+    if (ctx.IsNodeLeader())
+    {
+        DeserializeItemsets(data, kthCounts);
+        data = GatherData(SerializeItemsets(kthCounts), ctx.m_LeaderComm, true);
+        DeserializeItemsets(data, kthCounts);
+        data = SerializeItemsets(kthCounts);
+    }
+
+    if (ctx.m_NodeSize > 1)
+    {
+        int dataSize = data.size();
+        MPI_Bcast(&dataSize, 1, MPI_INT, 0, ctx.m_NodeComm);
+        data.resize(dataSize);
+        MPI_Bcast(data.data(), dataSize, MPI_INT, 0, ctx.m_NodeComm);
+
+        if (!ctx.IsNodeLeader())
+            DeserializeItemsets(data, kthCounts);
+    }
+
+    std::size_t numCandidates = 0;
+    for (const auto& pair : kthCounts)
+        numCandidates += pair.second.size();
+
+    // Phase two: exact global counts
+    LOG_DEBUG("SON phase two ...");
+    CountAllLevels(transactions, first, last, kthCounts, ctx);
+
+    PruneAllLevels(kthCounts, fsets.m_NumTrans, params.m_MinSup);
+
+    LOG_DEBUG("Done building frequent itemsets. candidates=" << numCandidates << " max_k=" << params.m_MaxK);
+
+    return fsets;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Sampling based mining (Toivonen). A random sample of the transactions is mined at a
+// lowered threshold and the result together with its negative border is verified with
+// one exact counting pass over all transactions. If no border itemset is frequent the
+// result is exact, otherwise the missed itemsets are reported and all transactions
+// are mined. With m_SampleApprox the sample estimates are returned without verification.
+FrequentItemsets SampleApriori(const Transactions& transactions, const ItemMap& imap, const Params& params, const MPIContext& ctx)
+{
+    FrequentItemsets fsets;
+    fsets.m_ItemMap = imap;
+    fsets.m_MinSup = params.m_MinSup;
+    fsets.m_MaxK = params.m_MaxK;
+
+    int first = 0;
+    int last = 0;
+    PartitionRange(0, transactions.Size(), ctx, first, last);
+
+    // Each process samples its own part of the transactions
+    std::mt19937 rng(params.m_SampleSeed + ctx.m_Rank);
+    std::bernoulli_distribution draw(params.m_SampleFraction);
+
+    Transactions sample;
+    for (int i = first; i < last; ++i)
+    {
+        if (draw(rng))
+            sample.Add(transactions[i]);
+    }
+
+    int localSampleSize = sample.Size();
+    int sampleSize = 0;
+    MPI_Allreduce(&localSampleSize, &sampleSize, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+    LOG_INFO("Transactions: " << transactions.Size() << " sample: " << sampleSize);
+
+    if (sampleSize == 0)
+    {
+        LOG_WARN("Sample is empty! Mining all transactions.");
+        return Apriori(transactions, imap, params, ctx);
+    }
+
+    // Hoeffding bound on the support error of any single itemset in the sample
+    const float supportError = std::sqrt(std::log(2.0 / params.m_SampleDelta) / (2.0 * sampleSize));
+
+    if (params.m_SampleApprox)
+    {
+        fsets.m_NumTrans = sampleSize;
+        fsets.m_SupportError = supportError;
+        MineLevels(sample, 0, sample.Size(), sampleSize, params.m_MinSup, params.m_MaxK,
+                   fsets.m_ItemMap, Constraints(params, imap), &ctx, fsets.m_KthItemsetCounts);
+        return fsets;
+    }
+
+    // Lower the threshold so itemsets are missed in the sample only with probability delta.
+    // Below half of min_sup the sample result and its border would hardly be smaller
+    // than the candidates of a full run.
+    const float lowMinSup = params.m_MinSup - std::sqrt(std::log(1.0 / params.m_SampleDelta) / (2.0 * sampleSize));
+    if (lowMinSup < params.m_MinSup * 0.5f)
+    {
+        LOG_WARN("Sample is too small for sample_delta=" << params.m_SampleDelta << "! Mining all transactions.");
+        return Apriori(transactions, imap, params, ctx);
+    }
+
+    LOG_DEBUG("Mining sample with min_sup=" << lowMinSup);
+
+    Itemsets border;
+    MineLevels(sample, 0, sample.Size(), sampleSize, lowMinSup, params.m_MaxK,
+               fsets.m_ItemMap, Constraints(params, imap), &ctx, fsets.m_KthItemsetCounts, &border);
+
+    // Verify the sample result and its negative border against all transactions
+    auto& kthCounts = fsets.m_KthItemsetCounts;
+    for (auto& pair : kthCounts)
+        for (auto& kvp : pair.second)
+            kvp.second = 0;
+
+    for (const auto& itemset : border)
+        kthCounts[itemset.Size()][itemset] = 0;
+
+    std::size_t numCandidates = 0;
+    for (const auto& pair : kthCounts)
+        numCandidates += pair.second.size();
+
+    LOG_INFO("Verifying " << numCandidates << " candidates (" << border.size() << " border itemsets) ...");
+    CountAllLevels(transactions, first, last, kthCounts, ctx);
+
+    fsets.m_NumTrans = transactions.Size();
+
+    Itemsets missed;
+    for (const auto& itemset : border)
+    {
+        if (IsFrequent(kthCounts[itemset.Size()][itemset], fsets.m_NumTrans, params.m_MinSup))
+            missed.push_back(itemset);
+    }
+
+    if (!missed.empty())
+    {
+        LOG_WARN("Sample missed " << missed.size() << " frequent border itemsets:");
+        for (const auto& itemset : missed)
+            LOG_WARN(itemset.ToString(fsets.m_ItemMap));
+
+        LOG_WARN("Mining all transactions!");
+        return Apriori(transactions, imap, params, ctx);
+    }
+
+    LOG_INFO("Sample result verified.");
+    PruneAllLevels(kthCounts, fsets.m_NumTrans, params.m_MinSup);
+
+    return fsets;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+bool CanUpdateIncrementally(const FrequentItemsets& prev, const Transactions& transactions, int numOld, const Params& params)
+{
+    if (prev.m_NumTrans != numOld)
+    {
+        LOG_WARN("Previous itemsets were mined from " << prev.m_NumTrans
+                    << " transactions but input has " << numOld);
+        return false;
+    }
+
+    if (prev.m_Checksum != ChecksumTransactions(transactions, numOld))
+    {
+        LOG_WARN("Previous itemsets were mined from other transactions than the input!");
+        return false;
+    }
+
+    if (prev.m_MinSup != params.m_MinSup)
+    {
+        LOG_WARN("Previous itemsets were mined with min_sup=" << prev.m_MinSup);
+        return false;
+    }
+
+    // Levels above the previous max_k were never mined
+    if (prev.m_MaxK > 0 && (params.m_MaxK <= 0 || params.m_MaxK > prev.m_MaxK))
+    {
+        LOG_WARN("Previous itemsets were mined with max_k=" << prev.m_MaxK);
+        return false;
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Items of lhs which are not in rhs
+Itemset Difference(const Itemset& lhs, const Itemset& rhs)
+{
+    Itemset result;
+    std::set_difference(
+        std::begin(lhs.m_Items), std::end(lhs.m_Items),
+        std::begin(rhs.m_Items), std::end(rhs.m_Items),
+        std::back_inserter(result.m_Items));
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Calls fn with every itemset of r of the (sorted) items
+template <typename Fn>
+void ForEachCombination(const std::vector<int>& items, int r, Fn&& fn)
+{
+    const int n = items.size();
+    if (r < 1 || r > n) return;
+
+    std::vector<int> indices(r);
+    for (int i = 0; i < r; ++i)
+        indices[i] = i;
+
+    Itemset itemset;
+    itemset.m_Items.resize(r);
+    while (true)
+    {
+        for (int i = 0; i < r; ++i)
+            itemset.m_Items[i] = items[indices[i]];
+        fn(itemset);
+
+        int i = r - 1;
+        while (i >= 0 && indices[i] == n - r + i) --i;
+        if (i < 0) return;
+
+        ++indices[i];
+        for (int j = i + 1; j < r; ++j)
+            indices[j] = indices[j - 1] + 1;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+void AddRule(const Itemset& antecedent, Itemset consequent, Rules& rules, float support, const FrequentItemsets& fsets, const Params& params)
+{
+    float conf = support / fsets.GetSupport(antecedent);
+    if (conf < params.m_MinConf) return;
+
+    Rule rule;
+    rule.m_Antidecent = antecedent;
+    rule.m_Consequent = std::move(consequent);
+    rule.m_Support = support;
+    rule.m_Confidence = conf;
+    rule.m_Lift = conf / fsets.GetSupport(rule.m_Consequent);
+
+    rules.push_back(std::move(rule));
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Rules of lhs with antecedents of m_MinAntecedent..m_MaxAntecedent items, enumerated
+// directly instead of shrinking the antecedent one item at a time. With consequent items
+// only their combinations in lhs are consequents.
+void GenerateBoundedRules(const Itemset& lhs, Rules& rules, float support, const FrequentItemsets& fsets, const Params& params, const Constraints& constraints)
+{
+    const int n = lhs.Size();
+    const int minAntecedent = std::max(1, constraints.m_MinAntecedent);
+    const int maxAntecedent = std::min(n - 1, constraints.m_MaxAntecedent);
+
+    if (!constraints.m_Consequents.empty())
+    {
+        std::vector<int> consequentItems;
+        std::set_intersection(
+            lhs.m_Items.begin(), lhs.m_Items.end(),
+            constraints.m_Consequents.begin(), constraints.m_Consequents.end(),
+            std::back_inserter(consequentItems));
+
+        for (int r = n - maxAntecedent; r <= n - minAntecedent; ++r)
+        {
+            ForEachCombination(consequentItems, r, [&](const Itemset& consequent)
+            {
+                AddRule(Difference(lhs, consequent), consequent, rules, support, fsets, params);
+            });
+        }
+    }
+    else
+    {
+        for (int r = minAntecedent; r <= maxAntecedent; ++r)
+        {
+            ForEachCombination(lhs.m_Items, r, [&](const Itemset& antecedent)
+            {
+                AddRule(antecedent, Difference(lhs, antecedent), rules, support, fsets, params);
+            });
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Shrinks the antecedent rhs of lhs one item at a time while the confidence holds.
+// visited holds the antecedents already tried so every rule is generated once.
+void GenerateRulesR(const Itemset& lhs, const Itemset& rhs, Rules& rules, float support, const FrequentItemsets& fsets,
+                    const Params& params, const Constraints& constraints, std::set<Itemset>& visited)
+{
+    for (const auto& itemset : rhs.Subsets())
+    {
+        if (!visited.insert(itemset).second) continue;
+
+        // Smaller antecedents only grow the consequent so the branch can be cut
+        auto consequent = Difference(lhs, itemset);
+        if (!constraints.IsConsequentAllowed(consequent)) continue;
+        if (itemset.Size() < constraints.m_MinAntecedent) continue;
+
+        const std::size_t numRules = rules.size();
+        AddRule(itemset, std::move(consequent), rules, support, fsets, params);
+
+        // Confidence only drops for smaller antecedents
+        if (rules.size() > numRules && itemset.m_Items.size() > 1)
+            GenerateRulesR(lhs, itemset, rules, support, fsets, params, constraints, visited);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+std::vector<Rule> GenerateRules(const FrequentItemsets& fsets, const Params& params, const MPIContext& ctx)
+{
+    LOG_INFO("GenerateRules ...");
+    std::vector<Rule> rules;
+    const Constraints constraints(params, fsets.m_ItemMap);
+
+     // Use the actual computed k rounds (could be less than max_k param)
+    int k = fsets.m_KthItemsetCounts.size();
+
+    // Rules are meaningles for k=1 (single item itemsets)
+    if (k == 1)
+    {
+        LOG_WARN("Rules can't be generated from single item itemsets(k=1)!");
+        return rules;
+    }
+
+    for (int i = 2; i <= k; ++i)
+    {
+        // Partition itemsets equally among processes
+        auto it = fsets.m_KthItemsetCounts.find(i);
+        if (it == fsets.m_KthItemsetCounts.end())
+        {
+            LOG_ERROR("k=" << i << " itemsets not found!");
+            exit(1);
+        }
+
+        const auto& itemsets = it->second;
+
+        int numItemsets = itemsets.size();
+        int first = ctx.m_Rank * numItemsets / ctx.m_Size;
+        int last = (ctx.m_Rank + 1) * numItemsets / ctx.m_Size;
+
+        auto firstIt = itemsets.begin();
+        std::advance(firstIt, first);
+
+        auto lastIt = firstIt;
+        std::advance(lastIt, last - first);
+        
+        for (;firstIt != lastIt; ++firstIt)
+        {
+            const auto& itemset = firstIt->first;
+            if (!constraints.IsRuleItemset(itemset)) continue;
+
+            float support = fsets.GetSupport(itemset);
+            if (constraints.m_MaxAntecedent > 0)
+            {
+                GenerateBoundedRules(itemset, rules, support, fsets, params, constraints);
+            }
+            else
+            {
+                std::set<Itemset> visited;
+                GenerateRulesR(itemset, itemset, rules, support, fsets, params, constraints, visited);
+            }
+        }
+    }
+
+    LOG_INFO("GenerateRules done.");
+
+    return rules;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// PARALLEL OUTPUT
+///////////////////////////////////////////////////////////////////////////////////////////
+// Every process formats its share of the itemsets and rules into one buffer and all
+// processes write into the same file at offsets from an exclusive scan of the sizes.
+//
+// Binary files start with a BinaryHeader followed by the item dictionary
+// ([uint32 num items] then [int32 id][uint32 length][chars] per item) and then by
+// numRecords fixed size records, so any record can be read at
+// recordsOffset + index * recordSize without loading the rest of the file.
+//
+// Itemset record: [int32 count][float support][int32 size][int32 items[maxItems]]
+// Rule record:    [float support][float confidence][float lift]
+//                 [int32 antecedent size][int32 consequent size][int32 items[maxItems]]
+// Unused item slots are -1. Rule items are the antecedent followed by the consequent.
+//
+// Supports estimated from a sample (--sample_approx) are only accurate to +/- the
+// support error, which is 0 for exact supports. CSV itemsets then get an extra column.
+struct BinaryHeader
+{
+    char            m_Magic[4];         // "APRI" for itemsets, "APRR" for rules
+    std::uint32_t   m_Version = 2;
+    std::uint32_t   m_RecordSize = 0;
+    std::uint32_t   m_MaxItems = 0;
+    std::uint64_t   m_NumRecords = 0;
+    std::uint64_t   m_RecordsOffset = 0;
+    std::uint64_t   m_NumTrans = 0;
+    float           m_SupportError = 0.f;
+    std::uint32_t   m_Reserved = 0;
+};
+static_assert(sizeof(BinaryHeader) == 48, "BinaryHeader layout must not change");
+
+///////////////////////////////////////////////////////////////////////////////////////////
+struct OutputBuffer
+{
+    void Append(const char* str, std::size_t size) { m_Data.insert(m_Data.end(), str, str + size); }
+    void Append(const std::string& str) { Append(str.data(), str.size()); }
+    void Append(char c) { m_Data.push_back(c); }
+
+    void AppendFloat(float value)
+    {
+        char buf[32];
+        int size = snprintf(buf, sizeof(buf), "%.5g", value); // Same as std::setprecision(5)
+        Append(buf, size);
+    }
+
+    template <typename T>
+    void AppendRaw(const T& value) { Append(reinterpret_cast<const char*>(&value), sizeof(T)); }
+
+    std::vector<char> m_Data;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Item names indexed by id to avoid map lookups while formatting
+std::vector<const std::string*> GetItemNames(const ItemMap& imap)
+{
+    static const std::string s_missing = "MISSING";
+    std::vector<const std::string*> names(imap.m_NextId, &s_missing);
+    for (const auto& pair : imap.m_IdToItem)
+        names[pair.first] = &pair.second;
+    return names;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Same format as Itemset::ToString with a ':' delimiter
+void AppendItemset(OutputBuffer& buffer, const Itemset& itemset, const std::vector<const std::string*>& names)
+{
+    buffer.Append('<');
+    for (int i = 0; i < itemset.m_Items.size(); ++i)
+    {
+        if (i > 0) buffer.Append(':');
+        buffer.Append(*names[itemset.m_Items[i]]);
+    }
+    buffer.Append('>');
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+void AppendItems(OutputBuffer& buffer, const Itemset& lhs, const Itemset& rhs, int maxItems)
+{
+    for (int item : lhs.m_Items)
+        buffer.AppendRaw<std::int32_t>(item);
+    for (int item : rhs.m_Items)
+        buffer.AppendRaw<std::int32_t>(item);
+    for (int i = lhs.Size() + rhs.Size(); i < maxItems; ++i)
+        buffer.AppendRaw<std::int32_t>(-1);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+void AppendItemDictionary(OutputBuffer& buffer, const ItemMap& imap)
+{
+    buffer.AppendRaw<std::uint32_t>(imap.m_IdToItem.size());
+    for (const auto& pair : imap.m_IdToItem)
+    {
+        buffer.AppendRaw<std::int32_t>(pair.first);
+        buffer.AppendRaw<std::uint32_t>(pair.second.size());
+        buffer.Append(pair.second);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+bool ReadItemDictionary(const char*& it, const char* end, ItemMap& outImap)
+{
+    auto read = [&](void* value, std::size_t size) -> bool
+    {
+        if (end - it < (std::ptrdiff_t)size) return false;
+        std::memcpy(value, it, size);
+        it += size;
+        return true;
+    };
+
+    std::uint32_t numItems = 0;
+    if (!read(&numItems, sizeof(numItems))) return false;
+
+    for (std::uint32_t i = 0; i < numItems; ++i)
+    {
+        std::int32_t id = 0;
+        std::uint32_t length = 0;
+        if (!read(&id, sizeof(id)) || !read(&length, sizeof(length))) return false;
+        if (end - it < (std::ptrdiff_t)length) return false;
+
+        outImap.Add(id, std::string(it, length));
+        it += length;
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Header and item dictionary of a binary file, written by rank 0 only
+void AppendBinaryHeader(OutputBuffer& buffer, const char* magic, std::uint32_t recordSize, std::uint32_t maxItems,
+                        std::uint64_t numRecords, const FrequentItemsets& fsets)
+{
+    OutputBuffer dict;
+    AppendItemDictionary(dict, fsets.m_ItemMap);
+
+    BinaryHeader header;
+    std::memcpy(header.m_Magic, magic, sizeof(header.m_Magic));
+    header.m_RecordSize = recordSize;
+    header.m_MaxItems = maxItems;
+    header.m_NumRecords = numRecords;
+    header.m_RecordsOffset = sizeof(BinaryHeader) + dict.m_Data.size();
+    header.m_NumTrans = fsets.m_NumTrans;
+    header.m_SupportError = fsets.m_SupportError;
+
+    buffer.AppendRaw(header);
+    buffer.Append(dict.m_Data.data(), dict.m_Data.size());
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Collectively writes the buffers of all processes one after another in rank order
+bool WriteParallel(const std::string& file, const OutputBuffer& buffer, const MPIContext& ctx)
+{
+    MPI_File fh;
+    int err = MPI_File_open(MPI_COMM_WORLD, file.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh);
+    if (err != MPI_SUCCESS)
+    {
+        LOG_ERROR("MPI_File_open failed with err: " << err << " fileName=" << file);
+        return false;
+    }
+
+    MPI_File_set_size(fh, 0);
+
+    long long size = buffer.m_Data.size();
+    long long offset = 0;
+    MPI_Exscan(&size, &offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (ctx.m_Rank == 0) offset = 0; // Undefined on rank 0
+
+    // Write counts are int so large buffers are written in chunks
+    const long long chunkSize = 1LL << 30;
+    long long numChunks = (size + chunkSize - 1) / chunkSize;
+    long long maxChunks = 0;
+    MPI_Allreduce(&numChunks, &maxChunks, 1, MPI_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+
+    bool ok = true;
+    for (long long i = 0; i < maxChunks; ++i)
+    {
+        long long first = std::min(i * chunkSize, size);
+        int count = std::min(chunkSize, size - first);
+        err = MPI_File_write_at_all(fh, offset + first, buffer.m_Data.data() + first, count, MPI_BYTE, MPI_STATUS_IGNORE);
+        if (err != MPI_SUCCESS)
+        {
+            LOG_ERROR("MPI_File_write_at_all failed with err: " << err << " fileName=" << file);
+            ok = false;
+        }
+    }
+
+    MPI_File_close(&fh);
+    return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Itemsets are split in equal contiguous parts among processes in the order of Print()
+bool WriteItemsets(const std::string& file, bool binary, const FrequentItemsets& fsets, const MPIContext& ctx)
+{
+    int numItemsets = 0;
+    int maxItems = 0;
+    for (const auto& pair : fsets.m_KthItemsetCounts)
+    {
+        numItemsets += pair.second.size();
+        if (!pair.second.empty())
+            maxItems = std::max(maxItems, pair.first);
+    }
+
+    int first = 0;
+    int last = 0;
+    PartitionRange(0, numItemsets, ctx, first, last);
+
+    const std::uint32_t recordSize = 3 * sizeof(std::int32_t) + maxItems * sizeof(std::int32_t);
+    const auto names = GetItemNames(fsets.m_ItemMap);
+    const bool approx = fsets.m_SupportError > 0.f;
+
+    OutputBuffer buffer;
+    if (ctx.m_Rank == 0)
+    {
+        if (binary)
+            AppendBinaryHeader(buffer, "APRI", recordSize, maxItems, numItemsets, fsets);
+        else
+            buffer.Append(approx ? "Itemset, Frequency, Support Error\n" : "Itemset, Frequency\n");
+    }
+
+    buffer.m_Data.reserve(buffer.m_Data.size() + (last - first) * (binary ? recordSize : 32));
+
+    int i = 0;
+    for (const auto& pair : fsets.m_KthItemsetCounts)
+    {
+        if (i + (int)pair.second.size() <= first)
+        {
+            i += pair.second.size();
+            continue;
+        }
+
+        for (const auto& itemsetCount : pair.second)
+        {
+            if (i >= last) break;
+            if (i++ < first) continue;
+
+            const float support = itemsetCount.second / (float)fsets.m_NumTrans;
+            if (binary)
+            {
+                buffer.AppendRaw<std::int32_t>(itemsetCount.second);
+                buffer.AppendRaw(support);
+                buffer.AppendRaw<std::int32_t>(itemsetCount.first.Size());
+                AppendItems(buffer, itemsetCount.first, Itemset{}, maxItems);
+            }
+            else
             {
-                bool found = true;
-                for (const auto& item : itemset.m_Items)
+                AppendItemset(buffer, itemsetCount.first, names);
+                buffer.Append(", ");
+                buffer.AppendFloat(support);
+                if (approx)
                 {
-                    if (std::find(t.begin(), t.end(), item) == t.end())
-                    {
-                        found = false;
-                        break;
-                    }
+                    buffer.Append(", ");
+                    buffer.AppendFloat(fsets.m_SupportError);
                 }
-
-                if (found) 
-                    counts[itemset] += 1;
+                buffer.Append('\n');
             }
         }
+    }
+
+    return WriteParallel(file, buffer, ctx);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Every process writes the rules it generated
+bool WriteRules(const std::string& file, bool binary, const FrequentItemsets& fsets, const Rules& rules, const MPIContext& ctx)
+{
+    int maxItems = 0;
+    for (const auto& pair : fsets.m_KthItemsetCounts)
+    {
+        if (!pair.second.empty())
+            maxItems = std::max(maxItems, pair.first);
+    }
+
+    long long numRules = rules.size();
+    MPI_Allreduce(MPI_IN_PLACE, &numRules, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+
+    const std::uint32_t recordSize = 5 * sizeof(std::int32_t) + maxItems * sizeof(std::int32_t);
+    const auto names = GetItemNames(fsets.m_ItemMap);
+
+    OutputBuffer buffer;
+    if (ctx.m_Rank == 0)
+    {
+        if (binary)
+            AppendBinaryHeader(buffer, "APRR", recordSize, maxItems, numRules, fsets);
+        else
+            buffer.Append("Antidecent, Consequent, Confidence, Lift\n");
+    }
+
+    buffer.m_Data.reserve(buffer.m_Data.size() + rules.size() * (binary ? recordSize : 64));
+
+    for (const auto& rule : rules)
+    {
+        if (binary)
+        {
+            buffer.AppendRaw(rule.m_Support);
+            buffer.AppendRaw(rule.m_Confidence);
+            buffer.AppendRaw(rule.m_Lift);
+            buffer.AppendRaw<std::int32_t>(rule.m_Antidecent.Size());
+            buffer.AppendRaw<std::int32_t>(rule.m_Consequent.Size());
+            AppendItems(buffer, rule.m_Antidecent, rule.m_Consequent, maxItems);
+        }
+        else
+        {
+            AppendItemset(buffer, rule.m_Antidecent, names);
+            buffer.Append(", ");
+            AppendItemset(buffer, rule.m_Consequent, names);
+            buffer.Append(", ");
+            buffer.AppendFloat(rule.m_Confidence);
+            buffer.Append(", ");
+            buffer.AppendFloat(rule.m_Lift);
+            buffer.Append('\n');
+        }
+    }
+
+    return WriteParallel(file, buffer, ctx);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Writes itemsets.<format> and rules.<format> to the output directory
+bool WriteOutput(const FrequentItemsets& fsets, const Rules& rules, const Params& params, const MPIContext& ctx)
+{
+    if (ctx.m_Rank == 0)
+        mkdir(params.m_OutputDir.c_str(), 0755); // May already exist
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    const bool binary = params.m_OutputFormat == "bin";
+    const std::string ext = binary ? ".bin" : ".csv";
+
+    bool ok = WriteItemsets(params.m_OutputDir + "/itemsets" + ext, binary, fsets, ctx);
+    ok = WriteRules(params.m_OutputDir + "/rules" + ext, binary, fsets, rules, ctx) && ok;
+    return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+void PrintResults(FrequentItemsets& fsets, const Rules& rules)
+{
+    std::cout << "Frequent Itemsets:\n";
+    fsets.Print();
+
+    std::cout << "\nRule | Confidence | Lift\n";
+    for (const auto& rule : rules)
+       std::cout << rule.ToString(fsets) << '\n';
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// CHECKPOINTS
+///////////////////////////////////////////////////////////////////////////////////////////
+// The mining state after each level is written to <dir>/checkpoint.bin as a
+// CheckpointHeader, the constraints key (m_ConstraintsSize chars), the item dictionary
+// (same as in binary output files) and one [int32 k][int32 count][int32 items[k]]
+// record per frequent itemset of levels 1..m_Level.
+// The frequent itemsets of m_Level are the ones the next level is generated from.
+// All processes write their share of the records to a temporary file which replaces
+// the previous checkpoint once complete.
+struct CheckpointHeader
+{
+    char            m_Magic[4] = { 'A', 'P', 'R', 'C' };
+    std::uint32_t   m_Version = 2;
+    std::int32_t    m_Level = 0;
+    std::int32_t    m_MaxK = 0;
+    float           m_MinSup = 0.f;
+    std::int32_t    m_NumTrans = 0;
+    std::uint64_t   m_NumRecords = 0;
+    std::uint64_t   m_RecordsOffset = 0;
+    std::uint64_t   m_Checksum = 0;         // Of the encoded transactions
+    std::uint32_t   m_ConstraintsSize = 0;
+    std::uint32_t   m_Reserved = 0;
+};
+static_assert(sizeof(CheckpointHeader) == 56, "CheckpointHeader layout must not change");
+
+///////////////////////////////////////////////////////////////////////////////////////////
+bool WriteCheckpoint(const std::string& dir, const FrequentItemsets& fsets, int level, std::uint64_t checksum,
+                     const Params& params, const MPIContext& ctx)
+{
+    if (ctx.m_Rank == 0)
+        mkdir(dir.c_str(), 0755); // May already exist
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    int numItemsets = 0;
+    for (const auto& pair : fsets.m_KthItemsetCounts)
+        numItemsets += pair.second.size();
+
+    int first = 0;
+    int last = 0;
+    PartitionRange(0, numItemsets, ctx, first, last);
+
+    OutputBuffer buffer;
+    if (ctx.m_Rank == 0)
+    {
+        const std::string constraints = params.ConstraintsKey();
+
+        OutputBuffer dict;
+        AppendItemDictionary(dict, fsets.m_ItemMap);
+
+        CheckpointHeader header;
+        header.m_Level = level;
+        header.m_MaxK = fsets.m_MaxK;
+        header.m_MinSup = fsets.m_MinSup;
+        header.m_NumTrans = fsets.m_NumTrans;
+        header.m_NumRecords = numItemsets;
+        header.m_RecordsOffset = sizeof(CheckpointHeader) + constraints.size() + dict.m_Data.size();
+        header.m_Checksum = checksum;
+        header.m_ConstraintsSize = constraints.size();
+
+        buffer.AppendRaw(header);
+        buffer.Append(constraints);
+        buffer.Append(dict.m_Data.data(), dict.m_Data.size());
+    }
+
+    int i = 0;
+    for (const auto& pair : fsets.m_KthItemsetCounts)
+    {
+        if (i + (int)pair.second.size() <= first)
+        {
+            i += pair.second.size();
+            continue;
+        }
+
+        for (const auto& itemsetCount : pair.second)
+        {
+            if (i >= last) break;
+            if (i++ < first) continue;
+
+            buffer.AppendRaw<std::int32_t>(pair.first);
+            buffer.AppendRaw<std::int32_t>(itemsetCount.second);
+            for (int item : itemsetCount.first.m_Items)
+                buffer.AppendRaw<std::int32_t>(item);
+        }
+    }
+
+    const std::string tmpFile = dir + "/checkpoint.tmp";
+    bool ok = WriteParallel(tmpFile, buffer, ctx);
+
+    if (ok && ctx.m_Rank == 0 && std::rename(tmpFile.c_str(), (dir + "/checkpoint.bin").c_str()) != 0)
+    {
+        LOG_ERROR("Failed to rename checkpoint! fileName=" << tmpFile);
+        ok = false;
+    }
+
+    LOG_DEBUG("Checkpoint written. k=" << level << " itemsets=" << numItemsets);
+    return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Reads the whole checkpoint, its itemset counts have all levels 1..m_Level
+bool ReadCheckpoint(const std::string& dir, Checkpoint& outCheckpoint)
+{
+    std::ifstream ifs(dir + "/checkpoint.bin", std::ios::binary);
+    if (!ifs.is_open()) return false;
+
+    std::vector<char> data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    const char* it = data.data();
+    const char* end = data.data() + data.size();
+
+    CheckpointHeader header;
+    if (data.size() < sizeof(header)) return false;
+    std::memcpy(&header, it, sizeof(header));
+    if (std::memcmp(header.m_Magic, CheckpointHeader{}.m_Magic, sizeof(header.m_Magic)) != 0 ||
+        header.m_Version != CheckpointHeader{}.m_Version)
+    {
+        return false;
+    }
+    it += sizeof(header);
+
+    if (end - it < (std::ptrdiff_t)header.m_ConstraintsSize) return false;
+    outCheckpoint.m_Constraints.assign(it, header.m_ConstraintsSize);
+    outCheckpoint.m_Checksum = header.m_Checksum;
+    it += header.m_ConstraintsSize;
+
+    auto& outFsets = outCheckpoint.m_Fsets;
+    const int level = header.m_Level;
+    outCheckpoint.m_Level = level;
+
+    outFsets = FrequentItemsets{};
+    outFsets.m_MaxK = header.m_MaxK;
+    outFsets.m_MinSup = header.m_MinSup;
+    outFsets.m_NumTrans = header.m_NumTrans;
+
+    if (!ReadItemDictionary(it, end, outFsets.m_ItemMap)) return false;
+    if (it != data.data() + header.m_RecordsOffset) return false;
+
+    auto readInt = [&](std::int32_t& value) -> bool
+    {
+        if (end - it < (std::ptrdiff_t)sizeof(value)) return false;
+        std::memcpy(&value, it, sizeof(value));
+        it += sizeof(value);
+        return true;
     };
 
-    ///////////////////////////////////////////////////////////////////////////////////////////
-    auto gather_1 = [&]()
+    for (int k = 1; k <= level; ++k)
+        outFsets.m_KthItemsetCounts[k];
+
+    for (std::uint64_t i = 0; i < header.m_NumRecords; ++i)
     {
-        LOG_DEBUG("Gather K=1 ...");
+        std::int32_t k = 0;
+        std::int32_t count = 0;
+        if (!readInt(k) || !readInt(count) || k < 1 || k > level) return false;
 
-        auto& counts = fsets.m_KthItemsetCounts[1];
-        std::vector<int> localCountsDataSizeForRank(ctx.m_Size);
-        std::vector<int> countOffsets;
-        countOffsets.reserve(ctx.m_Size);
-        
-        // Sum the number of non-zero counts we will be sending
-        int localCountsDataSize = 0;
-        for (const auto& kvp : counts)
+        Itemset itemset;
+        itemset.m_Items.resize(k);
+        for (auto& item : itemset.m_Items)
         {
-            if (kvp.second > 0) ++localCountsDataSize;
+            std::int32_t id = 0;
+            if (!readInt(id)) return false;
+            item = id;
         }
 
-        // Each count is a pair of an item id and count
-        localCountsDataSize = localCountsDataSize * 2;
+        outFsets.m_KthItemsetCounts[k][std::move(itemset)] = count;
+    }
+
+    return true;
+}
 
-        int err = MPI_SUCCESS;
+///////////////////////////////////////////////////////////////////////////////////////////
+void DebugAttachWait()
+{
+    LOG_DEBUG("Wating to attach debugger...");
 
-        // Exchange local counts data sizes 
-        // to calculate the global counts data size
-        err = MPI_Allgather(
-            &localCountsDataSize,
-            1,
-            MPI_INT,
-            localCountsDataSizeForRank.data(),
-            1,
-            MPI_INT,
-            MPI_COMM_WORLD);
+    volatile int i = 0;
+    char hostname[256];
+    gethostname(hostname, sizeof(hostname));
+    printf("PID %d on %s is ready for attach\n", getpid(), hostname);
+    fflush(stdout);
+    while(i == 0) 
+        sleep(5);
+}
 
-        if (err != MPI_SUCCESS)
+///////////////////////////////////////////////////////////////////////////////////////////
+void ReadInputData(std::istream& is, InputData& outData)
+{
+    for (std::string line; std::getline(is, line);)
+    {
+        outData.emplace_back();
+        std::stringstream ss(line);
+        for (std::string item; std::getline(ss, item, ',');)
         {
-            LOG_ERROR("MPI_Allgather failed with err: " << err);
-            exit(1);
+            // Trim leading whitespace
+            item.erase(item.begin(), std::find_if(item.begin(), item.end(), [](unsigned char c){
+                return !std::isspace(c);
+            }));
+
+            // Trim trailing whitespace
+            item.erase(std::find_if(item.rbegin(), item.rend(), [](unsigned char c){
+                return !std::isspace(c);
+            }).base(), item.end());
+            
+            if (!item.empty())
+                outData.back().emplace_back(item);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+bool ReadInputData(const std::string& file, InputData& outData)
+{
+    std::ifstream ifs(file);
+    if (!ifs.is_open()) return false;
+
+    ReadInputData(ifs, outData);
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Copies the item map of the node leader to all processes on the node
+void BroadcastItemMap(ItemMap& imap, const MPIContext& ctx)
+{
+    if (ctx.m_NodeSize == 1) return;
+
+    std::string data;
+    if (ctx.IsNodeLeader())
+    {
+        std::stringstream ss;
+        for (const auto& pair : imap.m_IdToItem)
+            ss << pair.first << '\t' << pair.second << '\n';
+        data = ss.str();
+    }
+
+    int size = data.size();
+    MPI_Bcast(&size, 1, MPI_INT, 0, ctx.m_NodeComm);
+    data.resize(size);
+    MPI_Bcast(&data[0], size, MPI_CHAR, 0, ctx.m_NodeComm);
+
+    if (ctx.IsNodeLeader()) return;
+
+    imap = ItemMap{};
+    std::stringstream ss(data);
+    for (std::string line; std::getline(ss, line);)
+    {
+        auto tab = line.find('\t');
+        imap.Add(std::stoi(line.substr(0, tab)), line.substr(tab + 1));
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Only the node leaders read and encode the input. The other processes on the node
+// share the encoded transactions of their leader. Appended transactions follow
+// the numOld input transactions.
+bool LoadTransactions(const Params& params, const MPIContext& ctx, ItemMap& imap, Transactions& outTransactions, int& outNumOld)
+{
+    bool ok = true;
+    outNumOld = 0;
+
+    if (ctx.IsNodeLeader())
+    {
+        InputData samples;
+        if (!ReadInputData(params.m_InputFile, samples))
+        {
+            LOG_ERROR("Failed to read input data from file! fileName=" << params.m_InputFile);
+            ok = false;
+        }
+
+        outNumOld = samples.size();
+        EncodeTransactions(samples, imap, outTransactions);
+
+        if (!params.m_AppendFile.empty())
+        {
+            InputData appendedSamples;
+            if (!ReadInputData(params.m_AppendFile, appendedSamples))
+            {
+                LOG_ERROR("Failed to read appended data from file! fileName=" << params.m_AppendFile);
+                ok = false;
+            }
+
+            EncodeTransactions(appendedSamples, imap, outTransactions);
         }
+    }
+
+    outTransactions.Share(ctx);
+    BroadcastItemMap(imap, ctx);
+    MPI_Bcast(&outNumOld, 1, MPI_INT, 0, ctx.m_NodeComm);
+
+    return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// STREAM MINING
+///////////////////////////////////////////////////////////////////////////////////////////
+// With --stream the transactions are read in batches of --batch_size and mined over a
+// sliding window of the last --window batches (panes). The candidates of the window,
+// i.e. its frequent itemsets and their negative border, are tracked with one count per
+// pane. Sliding the window counts the tracked itemsets in the new pane and subtracts
+// the counts of the expired pane. Only candidates which were not tracked before are
+// counted in all panes of the window. Items which no pane of the window contains
+// anymore are removed from the item map, so its size is bounded by the window.
+
+struct Pane
+{
+    Transactions                    m_Transactions; // Partition of the current process
+    int                             m_NumTrans = 0;
+    std::map<int, ItemsetCounts>    m_KthCounts;    // Counts of the tracked itemsets
+};
 
-        // Create offsets from running sum of global counts size
-        int globalCountsDataSize = 0;
-        for (int size : localCountsDataSizeForRank)
+struct StreamWindow
+{
+    std::deque<Pane>                m_Panes;
+    std::map<int, ItemsetCounts>    m_KthCounts;    // Sums of the pane counts
+    int                             m_NumTrans = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Rank 0 reads up to batchSize transactions and sends them to all processes.
+// Returns false at the end of the stream.
+bool ReceiveBatch(std::istream* is, int batchSize, InputData& outBatch)
+{
+    std::string data;
+    if (is)
+    {
+        std::string line;
+        for (int i = 0; i < batchSize && std::getline(*is, line); ++i)
         {
-            countOffsets.push_back(globalCountsDataSize);
-            globalCountsDataSize += size;
+            data += line;
+            data += '\n';
         }
+    }
 
-        // Gather counts data
-        std::vector<int> localCountsData;
-        localCountsData.reserve(localCountsDataSize);
+    int size = data.size();
+    MPI_Bcast(&size, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (size == 0) return false;
 
-        LOG_DEBUG("Local counts data:");
-        for (const auto& kvp : counts)
-        {
-            if (kvp.second > 0)
-            {
-                localCountsData.push_back(kvp.first.m_Items.front());
-                localCountsData.push_back(kvp.second);
+    data.resize(size);
+    MPI_Bcast(&data[0], size, MPI_CHAR, 0, MPI_COMM_WORLD);
 
-                LOG_DEBUG(kvp.first.ToString() << ": " << kvp.second);
-            }
-        }
+    outBatch.clear();
+    std::stringstream ss(data);
+    ReadInputData(ss, outBatch);
+    return true;
+}
 
-        std::vector<int> globalCountsData(globalCountsDataSize);
+///////////////////////////////////////////////////////////////////////////////////////////
+// Adds the batch as the newest pane of the window. All processes encode the whole
+// batch so item ids stay the same everywhere, but keep only their partition of it.
+void AddPane(StreamWindow& window, const InputData& batch, ItemMap& imap, const MPIContext& ctx)
+{
+    Transactions transactions;
+    EncodeTransactions(batch, imap, transactions);
+
+    int first = 0;
+    int last = 0;
+    PartitionRange(0, transactions.Size(), ctx, first, last);
+
+    window.m_Panes.emplace_back();
+    Pane& pane = window.m_Panes.back();
+    pane.m_NumTrans = transactions.Size();
+    for (int i = first; i < last; ++i)
+        pane.m_Transactions.Add(transactions[i]);
+}
 
-        err = MPI_Allgatherv(
-            localCountsData.data(),
-            localCountsData.size(),
-            MPI_INT,
-            globalCountsData.data(),
-            localCountsDataSizeForRank.data(),
-            countOffsets.data(),
-            MPI_INT,
-            MPI_COMM_WORLD);
+///////////////////////////////////////////////////////////////////////////////////////////
+// Starts tracking the level k candidates which are not tracked yet by counting them in all
+// panes with one reduction. Itemsets which are no longer candidates are not tracked anymore.
+void TrackCandidates(StreamWindow& window, const Itemsets& candidates, int k, const MPIContext& ctx)
+{
+    auto& tracked = window.m_KthCounts[k];
 
-        if (err != MPI_SUCCESS)
-        {
-            LOG_ERROR("MPI_Allgatherv failed with err: " << err);
-            exit(1);
-        }
+    ItemsetCounts counts;
+    Itemsets untracked;
+    for (const auto& itemset : candidates)
+    {
+        auto it = tracked.find(itemset);
+        if (it != tracked.end())
+            counts.insert(*it);
+        else
+            untracked.push_back(itemset);
+    }
 
-        // Merge counts from all processes into local data
-        counts.clear();
-        for (int i = 1; i < globalCountsDataSize; i+=2)
+    for (auto& pane : window.m_Panes)
+    {
+        auto& paneCounts = pane.m_KthCounts[k];
+        for (auto it = paneCounts.begin(); it != paneCounts.end();)
         {
-            counts[Itemset(globalCountsData[i-1])] += globalCountsData[i];
+            if (counts.find(it->first) == counts.end())
+                it = paneCounts.erase(it);
+            else
+                ++it;
         }
+    }
 
-        LOG_DEBUG("Global counts data for k=1:");
-        for (const auto& kvp : counts)
-        {
-            LOG_DEBUG(kvp.first.ToString() << ": " << kvp.second);
-        }
-    };
+    LOG_DEBUG("k=" << k << " tracked=" << counts.size() << " untracked=" << untracked.size());
 
-    ///////////////////////////////////////////////////////////////////////////////////////////
-    auto gather_k = [&](int k)
+    if (!untracked.empty())
     {
-        LOG_DEBUG("Gather k=" << k << " ...");
-        auto& counts = fsets.m_KthItemsetCounts[k];
-
-        // Reduce scatter
-        const int size = counts.size();
-        const int size_part = size / ctx.m_Size;
-        std::vector<int> sizes(ctx.m_Size, size_part);
-        
-        // Distribute remainder
-        for (int i = 0; i < size % ctx.m_Size; ++i) 
-            sizes[i] += 1;
+        std::vector<int> globalCounts;
+        globalCounts.reserve(window.m_Panes.size() * untracked.size());
 
-        std::vector<int> localCounts;
-        localCounts.reserve(size);
-
-        for (const auto& kvp : counts)
-            localCounts.push_back(kvp.second);
-
-        std::vector<int> globalCountsForRank(sizes[ctx.m_Rank]);
-
-        LOG_DEBUG("MPI_Reduce_scatter start");
-        LOG_DEBUG("counts size =" << size);
-        LOG_DEBUG("size part = " << size_part);
-        MPI_Reduce_scatter(
-            localCounts.data(), /*sendbuf*/
-            globalCountsForRank.data(), /*recvbuf*/
-            sizes.data(), /*recvcounts*/
-            MPI_INT,
-            MPI_SUM,
-            MPI_COMM_WORLD
-        );
-        LOG_DEBUG("MPI_Reduce_scatter end");
-
-        // All gather
-        std::vector<int> globalCounts(size);
-        std::vector<int> globalCountsOffsets;
-
-        int offsetSum = 0;
-        for (const auto& size : sizes)
-        {
-            globalCountsOffsets.push_back(offsetSum);
-            offsetSum += size;
-        }
-
-        LOG_DEBUG("MPI_Allgatherv start");
-        MPI_Allgatherv(
-            globalCountsForRank.data(), /*sendbuf*/
-            globalCountsForRank.size(), /*sendcount*/
-            MPI_INT,
-            globalCounts.data(), /*recvbuf*/
-            sizes.data(), /*recvcounts*/
-            globalCountsOffsets.data(), /*displacements*/
-            MPI_INT,
-            MPI_COMM_WORLD
-        );
-        LOG_DEBUG("MPI_Allgatherv end");
-
-        // Update final counts assuming dict is ordered
-        int i = 0;
-        for (auto it = counts.begin(); it != counts.end(); ++it, ++i)
+        for (const auto& pane : window.m_Panes)
         {
-            it->second = globalCounts[i];
+            ItemsetCounts paneCounts;
+            CountItemsets(pane.m_Transactions, 0, pane.m_Transactions.Size(), untracked, k, paneCounts);
+            for (const auto& itemset : untracked)
+                globalCounts.push_back(paneCounts[itemset]);
         }
-    };
 
-    ///////////////////////////////////////////////////////////////////////////////////////////
-    auto prune = [&](const std::vector<Itemset>& itemsets, int k)
-    {
-        std::vector<Itemset> result;
-        auto& counts = fsets.m_KthItemsetCounts[k];
-        for (const auto& itemset : itemsets)
+        ReduceCounts(globalCounts, ctx);
+
+        int i = 0;
+        for (auto& pane : window.m_Panes)
         {
-            if (counts[itemset] / (float)fsets.m_NumTrans < params.m_MinSup)
+            for (const auto& itemset : untracked)
             {
-                counts.erase(itemset);
-            }
-            else
-            {
-                result.push_back(itemset);
+                pane.m_KthCounts[k][itemset] = globalCounts[i];
+                counts[itemset] += globalCounts[i];
+                ++i;
             }
         }
+    }
 
-        return result;
-    };
-
-    ///////////////////////////////////////////////////////////////////////////////////////////
-    auto gen_L1 = [&]() -> Itemsets
-    {
-        LOG_DEBUG("Generating L=1 ...");
-        
-        std::vector<Itemset> c1;
-        c1.reserve(fsets.m_ItemMap.m_ItemToId.size());
-        for (const auto& pair: fsets.m_ItemMap.m_IdToItem) 
-            c1.emplace_back(pair.first);
+    tracked.swap(counts);
+}
 
-        count(c1, 1);
-        gather_1();
-        return prune(c1, 1);
-    };
+///////////////////////////////////////////////////////////////////////////////////////////
+// Counts the tracked itemsets in the newest pane, removes the expired pane and its items
+// and mines the window level-wise from the tracked counts. Returns the frequent itemsets
+// in outKthCounts.
+void SlideWindow(StreamWindow& window, int numPanes, ItemMap& imap, const Constraints& constraints,
+                 const Params& params, const MPIContext& ctx, std::map<int, ItemsetCounts>& outKthCounts)
+{
+    auto& kthCounts = window.m_KthCounts;
 
     ///////////////////////////////////////////////////////////////////////////////////////////
-    auto gen_Lk = [&](const Itemsets& itemsets, int k) -> Itemsets
+    auto add = [&](const Pane& pane, int sign)
     {
-        LOG_DEBUG("Generating L=" << k << "...");
-        Itemsets result;
-
-        const auto& counts = fsets.m_KthItemsetCounts[k-1]; // Counts for k-1 subsets
-        
-        auto same_prefix = [](const Itemset& lhs, const Itemset& rhs)
+        for (const auto& pair : pane.m_KthCounts)
         {
-            if (lhs.m_Items.size() != rhs.m_Items.size()) return false;
-            for (int i = 0; i < lhs.m_Items.size() - 1; ++i)
+            auto& counts = kthCounts[pair.first];
+            for (const auto& kvp : pair.second)
             {
-                if (lhs.m_Items[i] != rhs.m_Items[i]) return false; // Mismatch
-            }
-            return true; // Same (size - 1) prefix
-        };
-
-        for (int i = 0; i < itemsets.size(); ++i)
-        {
-            const auto& lhs = itemsets[i];
-
-            for (int j = i+1; j < itemsets.size(); ++j)
-            {    
-                const auto& rhs = itemsets[j];
-
-                // Require same prefix
-                if (!same_prefix(lhs, rhs)) break;
-
-                // Create new itemset (lhs + last element of rhs)
-                Itemset itemset = lhs;
-                itemset.m_Items.push_back(rhs.m_Items.back());
-
-                // Check if all k-1 subsets are frequent
-                bool valid = true;
-                for (const auto& subset : itemset.Subsets())
-                {
-                    if (counts.find(subset) == counts.end())
-                    {
-                        valid = false;
-                        break;
-                    }
-                }
-
-                if (valid) 
-                    result.emplace_back(std::move(itemset));
+                auto it = counts.find(kvp.first);
+                if (it != counts.end())
+                    it->second += sign * kvp.second;
             }
         }
-
-        return result;
+        window.m_NumTrans += sign * pane.m_NumTrans;
     };
 
-    ///////////////////////////////////////////////////////////////////////////////////////////
-    int k = 2;
-    Itemsets L = gen_L1();
+    // All items are tracked, also the ones the constraints don't allow, so expired items
+    // are known. New items have no counts in older panes.
+    for (const auto& pair : imap.m_IdToItem)
+        kthCounts[1].emplace(Itemset(pair.first), 0);
 
-    while (L.size() > 0)
+    Pane& pane = window.m_Panes.back();
+    for (const auto& pair : kthCounts)
     {
-        if (params.m_MaxK > 0 && k > params.m_MaxK) break;
-        Itemsets C = gen_Lk(L, k);
-        count(C, k);
-        LOG_DEBUG("k=" << k << " candidate itemsets:");
-        for (const auto& itemset : C)
-            LOG_DEBUG(itemset.ToString());
+        auto& paneCounts = pane.m_KthCounts[pair.first];
+        for (const auto& kvp : pair.second)
+            paneCounts.emplace(kvp.first, 0);
+    }
 
-        gather_k(k);
-        L = prune(C, k);
+    CountAllLevels(pane.m_Transactions, 0, pane.m_Transactions.Size(), pane.m_KthCounts, ctx);
+    add(pane, 1);
 
-        LOG_DEBUG("k=" << k << " pruned itemsets:");
-        for (const auto& itemset : L)
-            LOG_DEBUG(itemset.ToString());
-        
-        ++k;
+    if (window.m_Panes.size() > numPanes)
+    {
+        add(window.m_Panes.front(), -1);
+        window.m_Panes.pop_front();
     }
 
-    LOG_DEBUG("Done building frequent itemsets. k=" << k << " max_k=" << params.m_MaxK);
+    // No transaction of the window contains the items without counts. Tracked itemsets of
+    // higher levels which contain them are dropped below as they are no candidates.
+    for (auto it = kthCounts[1].begin(); it != kthCounts[1].end();)
+    {
+        if (it->second > 0)
+        {
+            ++it;
+            continue;
+        }
 
-    return fsets;
-}
+        for (auto& windowPane : window.m_Panes)
+            windowPane.m_KthCounts[1].erase(it->first);
+        imap.Remove(it->first.m_Items.front());
+        it = kthCounts[1].erase(it);
+    }
 
-///////////////////////////////////////////////////////////////////////////////////////////
-void GenerateRulesR(const Itemset& lhs, const Itemset& rhs, Rules& rules, float support, const FrequentItemsets& fsets, const Params& params)
-{
-    auto subtract = [](const Itemset& lhs, const Itemset& rhs) -> Itemset
+    ///////////////////////////////////////////////////////////////////////////////////////////
+    Itemsets L1;
+    for (const auto& kvp : kthCounts[1])
     {
-        Itemset result;
-        std::set_difference(
-            std::begin(lhs.m_Items), std::end(lhs.m_Items),
-            std::begin(rhs.m_Items), std::end(rhs.m_Items),
-            std::back_inserter(result.m_Items));
+        if (constraints.IsItemAllowed(kvp.first.m_Items.front()) &&
+            IsFrequent(kvp.second, window.m_NumTrans, params.m_MinSup))
+        {
+            L1.push_back(kvp.first);
+            outKthCounts[1].insert(kvp);
+        }
+    }
 
-        return result;
-    };
+    int k = 2;
+    Itemsets L = L1;
 
-    for (const auto& itemset : rhs.Subsets())
+    for (; L.size() > 0; ++k)
     {
-        float conf = support / fsets.GetSupport(itemset);
-        if (conf >= params.m_MinConf)
-        {
-            Rule rule;
-            rule.m_Antidecent = itemset;
-            rule.m_Consequent = subtract(lhs, itemset);
-            rule.m_Confidence = conf;
-            rule.m_Lift = conf / fsets.GetSupport(rule.m_Consequent);
+        if (params.m_MaxK > 0 && k > params.m_MaxK) break;
 
-            rules.push_back(std::move(rule));
+        Itemsets C = constraints.HasTrackedSubset() ? GenerateTrackedCandidates(L, L1, outKthCounts[k-1], constraints)
+                                                    : GenerateCandidates(L, outKthCounts[k-1]);
+        TrackCandidates(window, C, k, ctx);
 
-            if (itemset.m_Items.size() > 1)
-                GenerateRulesR(lhs, itemset, rules, support, fsets, params);
+        L.clear();
+        auto& counts = outKthCounts[k];
+        for (const auto& kvp : kthCounts[k])
+        {
+            if (IsFrequent(kvp.second, window.m_NumTrans, params.m_MinSup))
+            {
+                L.push_back(kvp.first);
+                counts.insert(kvp);
+            }
         }
     }
+
+    // Levels which have no candidates anymore are not tracked
+    kthCounts.erase(kthCounts.lower_bound(k), kthCounts.end());
+    for (auto& pane : window.m_Panes)
+        pane.m_KthCounts.erase(pane.m_KthCounts.lower_bound(k), pane.m_KthCounts.end());
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////
-std::vector<Rule> GenerateRules(const FrequentItemsets& fsets, const Params& params, const MPIContext& ctx)
+// Mines the stream window by window and emits the itemsets and rules of every step,
+// to <output>/window_<step> if an output directory is given
+bool StreamApriori(const Params& params, const MPIContext& ctx)
 {
-    LOG_INFO("GenerateRules ...");
-    std::vector<Rule> rules;
-
-     // Use the actual computed k rounds (could be less than max_k param)
-    int k = fsets.m_KthItemsetCounts.size();
+    bool ok = true;
+    std::ifstream ifs;
+    std::istream* is = nullptr;
 
-    // Rules are meaningles for k=1 (single item itemsets)
-    if (k == 1)
-    {
-        LOG_WARN("Rules can't be generated from single item itemsets(k=1)!");
-        return rules;
-    }
-
-    for (int i = 2; i <= k; ++i)
+    if (ctx.m_Rank == 0)
     {
-        // Partition itemsets equally among processes
-        auto it = fsets.m_KthItemsetCounts.find(i);
-        if (it == fsets.m_KthItemsetCounts.end())
+        if (params.m_StreamFile == "-")
         {
-            LOG_ERROR("k=" << i << " itemsets not found!");
-            exit(1);
+            is = &std::cin;
+        }
+        else
+        {
+            ifs.open(params.m_StreamFile);
+            is = &ifs;
+            ok = ifs.is_open();
         }
 
-        const auto& itemsets = it->second;
-
-        int numItemsets = itemsets.size();
-        int first = ctx.m_Rank * numItemsets / ctx.m_Size;
-        int last = (ctx.m_Rank + 1) * numItemsets / ctx.m_Size;
-
-        auto firstIt = itemsets.begin();
-        std::advance(firstIt, first);
-
-        auto lastIt = firstIt;
-        std::advance(lastIt, last - first);
-        
-        for (;firstIt != lastIt; ++firstIt)
+        if (!ok)
         {
-            const auto& itemset = firstIt->first;
-            float support = fsets.GetSupport(itemset);
-            GenerateRulesR(itemset, itemset, rules, support, fsets, params);
+            LOG_ERROR("Failed to open stream! fileName=" << params.m_StreamFile);
+        }
+        else if (!params.m_OutputDir.empty())
+        {
+            mkdir(params.m_OutputDir.c_str(), 0755); // May already exist
         }
     }
 
-    LOG_INFO("GenerateRules done.");
-
-    return rules;
-}
-
-///////////////////////////////////////////////////////////////////////////////////////////
-bool RulesToCsv(const FrequentItemsets& fsets, const std::vector<Rule> rules, const std::string& file)
-{
-    if (rules.empty()) return false;
+    MPI_Bcast(&ok, 1, MPI_CXX_BOOL, 0, MPI_COMM_WORLD);
+    if (!ok) return false;
 
-    std::ofstream ofs(file, std::ios::trunc);
-    if (!ofs.is_open()) return false;
+    ItemMap imap;
+    StreamWindow window;
+    InputData batch;
 
-    ofs << "Antidecent, Consequent, Confidence, Lift\n"; // Columns names
-    for (const auto& rule : rules)
+    for (int step = 0; ReceiveBatch(is, params.m_BatchSize, batch); ++step)
     {
-        ofs << rule.m_Antidecent.ToString(fsets.m_ItemMap, ':').c_str() << ", ";
-        ofs << rule.m_Consequent.ToString(fsets.m_ItemMap, ':').c_str() << ", ";
-        ofs << std::setprecision(5) << rule.m_Confidence << ", ";
-        ofs << std::setprecision(5) << rule.m_Lift << '\n';
-    }
+        AddPane(window, batch, imap, ctx);
 
-    return true;
-}
+        FrequentItemsets fsets;
+        fsets.m_MinSup = params.m_MinSup;
+        fsets.m_MaxK = params.m_MaxK;
 
-///////////////////////////////////////////////////////////////////////////////////////////
-void DebugAttachWait()
-{
-    LOG_DEBUG("Wating to attach debugger...");
+        // Constraints refer to item ids which may only now exist
+        SlideWindow(window, params.m_WindowPanes, imap, Constraints(params, imap), params, ctx, fsets.m_KthItemsetCounts);
+        fsets.m_ItemMap = imap;
+        fsets.m_NumTrans = window.m_NumTrans;
 
-    volatile int i = 0;
-    char hostname[256];
-    gethostname(hostname, sizeof(hostname));
-    printf("PID %d on %s is ready for attach\n", getpid(), hostname);
-    fflush(stdout);
-    while(i == 0) 
-        sleep(5);
-}
+        LOG_INFO("Window step=" << step << " transactions=" << window.m_NumTrans << " panes=" << window.m_Panes.size()
+                    << " items=" << imap.m_IdToItem.size());
 
-///////////////////////////////////////////////////////////////////////////////////////////
-bool ReadInputData(const std::string& file, InputData& outData)
-{
-    std::ifstream ifs(file);
-    if (!ifs.is_open()) return false;
+        auto rules = GenerateRules(fsets, params, ctx);
 
-    for (std::string line; std::getline(ifs, line);)
-    {
-        outData.emplace_back();
-        std::stringstream ss(line);
-        for (std::string item; std::getline(ss, item, ',');)
+        if (!params.m_OutputDir.empty())
         {
-            // Trim leading whitespace
-            item.erase(item.begin(), std::find_if(item.begin(), item.end(), [](unsigned char c){
-                return !std::isspace(c);
-            }));
-
-            // Trim trailing whitespace
-            item.erase(std::find_if(item.rbegin(), item.rend(), [](unsigned char c){
-                return !std::isspace(c);
-            }).base(), item.end());
-            
-            if (!item.empty())
-                outData.back().emplace_back(item);
+            Params stepParams = params;
+            stepParams.m_OutputDir = params.m_OutputDir + "/window_" + std::to_string(step);
+            ok = WriteOutput(fsets, rules, stepParams, ctx) && ok;
+        }
+        else
+        {
+            std::cout << "Window " << step << ":\n";
+            PrintResults(fsets, rules);
         }
     }
 
-    return true;
+    return ok;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////
@@ -816,42 +3582,111 @@ int main(int argc, char* argv[])
     }
     else
     {
-        LOG_INFO("Params (input=" << params.m_InputFile
+        LOG_INFO("Params (input=" << (params.m_StreamFile.empty() ? params.m_InputFile : params.m_StreamFile)
                     << " max_k=" << params.m_MaxK 
                     << " min_sup=" << params.m_MinSup
-                    << " min_conf=" << params.m_MinConf);
-    }
-
-    InputData samples;
-    if (!ReadInputData(params.m_InputFile, samples))
-    {
-        LOG_ERROR("Failed to read input data from file! fileName=" << params.m_InputFile);
-        return 1;
+                    << " min_conf=" << params.m_MinConf
+                    << " algorithm=" << params.m_Algorithm
+                    << " sample_fraction=" << params.m_SampleFraction);
     }
 
     LOG_DEBUG("Initializing MPI...");
     MPI_Init(&argc, &argv);
 
     MPIContext ctx;
-    MPI_Comm_size(MPI_COMM_WORLD, &ctx.m_Size);
-	MPI_Comm_rank(MPI_COMM_WORLD, &ctx.m_Rank);
+    InitMPIContext(ctx, params.m_RanksPerNode);
+    ctx.m_CompressCounts = params.m_CompressCounts;
 
-    LOG_INFO("MPI Initialized" << " rank=" << ctx.m_Rank << "/" << ctx.m_Size);
+    LOG_INFO("MPI Initialized" << " rank=" << ctx.m_Rank << "/" << ctx.m_Size
+                << " node=" << ctx.m_NodeId << "/" << ctx.m_NumNodes
+                << " node_rank=" << ctx.m_NodeRank << "/" << ctx.m_NodeSize);
 
-    auto fsets = Apriori(samples, params, ctx);
+    int exitCode = 0;
+    if (!params.m_StreamFile.empty())
+    {
+        if (!StreamApriori(params, ctx))
+            exitCode = 1;
+    }
+    else
+    {
+        bool ok = true;
+        FrequentItemsets prevFsets;
+        if (!params.m_AppendFile.empty() && !prevFsets.Load(params.m_PrevFsetsFile))
+        {
+            LOG_ERROR("Failed to load previous frequent itemsets from file! fileName=" << params.m_PrevFsetsFile);
+            ok = false;
+        }
 
-    std::cout << "Frequent Itemsets:\n";
-    fsets.Print();
-    //fsets.ToCsv("frequent_itemsets.csv");
+        // Resume with the item ids of the checkpoint
+        Checkpoint checkpoint;
+        bool resume = params.m_Resume && ReadCheckpoint(params.m_CheckpointDir, checkpoint);
+        MPI_Allreduce(MPI_IN_PLACE, &resume, 1, MPI_CXX_BOOL, MPI_LAND, MPI_COMM_WORLD);
+        if (params.m_Resume && !resume)
+        {
+            LOG_WARN("No checkpoint to resume from! dir=" << params.m_CheckpointDir);
+        }
+        else if (resume)
+        {
+            LOG_INFO("Checkpoint loaded. k=" << checkpoint.m_Level);
+        }
 
-    auto rules = GenerateRules(fsets, params, ctx);
-    std::cout << "\nRule | Confidence | Lift\n";
-    for (const auto& rule : rules)
-       std::cout << rule.ToString(fsets) << '\n';
-    //RulesToCsv(fsets, rules, "rules.csv");
+        // Item ids of the previous itemsets are kept
+        ItemMap imap = resume ? checkpoint.m_Fsets.m_ItemMap : prevFsets.m_ItemMap;
+        Transactions transactions;
+        int numOld = 0;
+        ok = LoadTransactions(params, ctx, imap, transactions, numOld) && ok;
+
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_CXX_BOOL, MPI_LAND, MPI_COMM_WORLD);
+        if (!ok)
+        {
+            exitCode = 1;
+        }
+        else
+        {
+            FrequentItemsets fsets;
+            if (params.m_AppendFile.empty() && params.m_SampleFraction > 0.f)
+            {
+                fsets = SampleApriori(transactions, imap, params, ctx);
+            }
+            else if (params.m_AppendFile.empty())
+            {
+                fsets = params.m_Algorithm == "son" ? SonApriori(transactions, imap, params, ctx)
+                                                    : Apriori(transactions, imap, params, ctx, resume ? &checkpoint : nullptr);
+            }
+            else if (CanUpdateIncrementally(prevFsets, transactions, numOld, params))
+            {
+                fsets = IncrementalApriori(prevFsets, transactions, numOld, imap, params, ctx);
+            }
+            else
+            {
+                LOG_WARN("Falling back to mining all transactions!");
+                fsets = Apriori(transactions, imap, params, ctx);
+            }
+
+            if (!params.m_SaveFsetsFile.empty() && ctx.m_Rank == 0)
+            {
+                fsets.m_Checksum = ChecksumTransactions(transactions, transactions.Size());
+                if (!fsets.Save(params.m_SaveFsetsFile))
+                    LOG_ERROR("Failed to save frequent itemsets to file! fileName=" << params.m_SaveFsetsFile);
+            }
+
+            auto rules = GenerateRules(fsets, params, ctx);
+
+            if (!params.m_OutputDir.empty())
+            {
+                if (!WriteOutput(fsets, rules, params, ctx))
+                    exitCode = 1;
+            }
+            else
+            {
+                PrintResults(fsets, rules);
+            }
+        }
+    }
 
+    FreeMPIContext(ctx);
     MPI_Finalize();
     LOG_INFO("MPI finalized");
 
-    return 0;
-}
\ No newline at end of file
+    return exitCode;
+}
@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Mines the first transactions of sample_tiny.csv, updates the saved itemsets with the
+# appended transactions and checks that the result is identical to a full re-mine.
+
+JOB_ID="test-append-job"
+N_PROC=2
+CSV_FILE=sample_tiny.csv
+OLD_CSV_FILE=sample_tiny_old.csv
+NEW_CSV_FILE=sample_tiny_new.csv
+RESULT_FILE=sample_tiny_append_result.txt
+PARAMS="--max_k 3 --min_sup 0.25 --min_conf 0.5"
+
+source ./test_common.sh
+
+FSETS_FILE="${JOB_PATH}/old.fsets"
+
+run full ${N_PROC} --input ${CSV_FILE} ${PARAMS}
+run old ${N_PROC} --input ${OLD_CSV_FILE} ${PARAMS} --save_fsets ${FSETS_FILE}
+run append ${N_PROC} --input ${OLD_CSV_FILE} --append ${NEW_CSV_FILE} --prev_fsets ${FSETS_FILE} ${PARAMS}
+
+if grep -q "Falling back" ${JOB_PATH}/append.log; then
+    fail "itemsets were not updated incrementally"
+fi
+
+for RUN in full append; do
+    diff ${RESULT_FILE} <(result ${JOB_PATH}/${RUN}) > /dev/null || fail "${RUN} result differs from ${RESULT_FILE}"
+done
+
+# Same number of old transactions but not the ones the itemsets were mined from
+run other ${N_PROC} --input ${NEW_CSV_FILE} --append ${OLD_CSV_FILE} --prev_fsets ${FSETS_FILE} ${PARAMS}
+expect_log other "other transactions than the input"
+expect_log other "Falling back"
+expect_same ${JOB_PATH}/full ${JOB_PATH}/other
+
+echo "OK"
@@ -0,0 +1,74 @@
+#!/bin/bash
+
+# Mines sample_medium.csv with checkpoints, cuts a checkpoint back to level 2 and checks
+# that resuming it with another number of processes gives the result of a full run.
+# Checkpoints of other constraints or other transactions must be ignored.
+
+JOB_ID="test-checkpoint-job"
+N_PROC=2
+CSV_FILE=sample_medium.csv
+PARAMS="--max_k 4 --min_sup 0.02 --min_conf 0.3"
+
+source test_common.sh
+
+OTHER_CSV_FILE="${JOB_PATH}/other.csv"
+
+# truncate <checkpoint dir> <level>: keeps the itemsets of levels 1..level
+truncate_checkpoint() {
+    python3 - $1/checkpoint.bin $2 <<'PY'
+import struct, sys
+
+path, level = sys.argv[1], int(sys.argv[2])
+data = open(path, 'rb').read()
+
+# CheckpointHeader
+HEADER = '<4sIiifiQQQII'
+header = list(struct.unpack_from(HEADER, data))
+num_records, records_offset = header[6], header[7]
+
+records, pos = [], records_offset
+for _ in range(num_records):
+    k = struct.unpack_from('<i', data, pos)[0]
+    size = 8 + 4 * k
+    if k <= level:
+        records.append(data[pos:pos + size])
+    pos += size
+
+header[2], header[6] = level, len(records)
+with open(path, 'wb') as f:
+    f.write(struct.pack(HEADER, *header) + data[struct.calcsize(HEADER):records_offset] + b''.join(records))
+PY
+}
+
+run full ${N_PROC} --input ${CSV_FILE} ${PARAMS}
+
+run checkpoint ${N_PROC} --input ${CSV_FILE} ${PARAMS} --checkpoint ${JOB_PATH}/ck
+expect_same ${JOB_PATH}/full ${JOB_PATH}/checkpoint
+truncate_checkpoint ${JOB_PATH}/ck 2
+
+for NP in 1 3; do
+    cp -r ${JOB_PATH}/ck ${JOB_PATH}/ck_${NP}
+    run resume_${NP} ${NP} --input ${CSV_FILE} ${PARAMS} --checkpoint ${JOB_PATH}/ck_${NP} --resume
+    expect_log resume_${NP} "Resuming from k=3"
+    expect_same ${JOB_PATH}/full ${JOB_PATH}/resume_${NP}
+done
+
+# Checkpoint of a constrained run
+run constrained ${N_PROC} --input ${CSV_FILE} ${PARAMS} --exclude I0 --checkpoint ${JOB_PATH}/ck_constrained
+truncate_checkpoint ${JOB_PATH}/ck_constrained 2
+run resume_constrained ${N_PROC} --input ${CSV_FILE} ${PARAMS} --checkpoint ${JOB_PATH}/ck_constrained --resume
+expect_log resume_constrained "different constraints"
+expect_same ${JOB_PATH}/full ${JOB_PATH}/resume_constrained
+
+# Same number of transactions, but one of them differs
+sed '1s/^I0, /I5, /' ${CSV_FILE} > ${OTHER_CSV_FILE}
+cmp -s ${CSV_FILE} ${OTHER_CSV_FILE} && fail "${OTHER_CSV_FILE} equals ${CSV_FILE}"
+cp -r ${JOB_PATH}/ck ${JOB_PATH}/ck_other
+run other ${N_PROC} --input ${OTHER_CSV_FILE} ${PARAMS}
+run resume_other ${N_PROC} --input ${OTHER_CSV_FILE} ${PARAMS} --checkpoint ${JOB_PATH}/ck_other --resume
+expect_log resume_other "different transactions"
+
+# The item ids of the checkpoint are kept
+expect_same_items ${JOB_PATH}/other ${JOB_PATH}/resume_other
+
+echo "OK"
@@ -0,0 +1,56 @@
+#!/bin/bash
+
+# Shared setup of the test scripts, sourced after JOB_ID and N_PROC are set.
+# The scripts run ./apriori_mpi, build it with make apriori_mpi first.
+
+DATA_PATH="/var/dist-apriori-data"
+if [ ! -d ${DATA_PATH} ]; then
+    DATA_PATH="dist-apriori-data"
+fi
+
+JOB_PATH="${DATA_PATH}/${JOB_ID}"
+
+echo "Running ${JOB_ID} with ${N_PROC} processes..."
+
+rm -rf ${JOB_PATH}
+mkdir -p ${JOB_PATH}
+
+fail() {
+    echo "FAILED: $*"
+    exit 1
+}
+
+# run <name> <num processes> <args...>
+# Output goes to ${JOB_PATH}/<name> and the log to ${JOB_PATH}/<name>.log
+run() {
+    local NAME=$1
+    local NP=$2
+    shift 2
+    mpiexec -n ${NP} ./apriori_mpi "$@" --output ${JOB_PATH}/${NAME} > ${JOB_PATH}/${NAME}.log 2>&1 || fail "${NAME} exited with an error"
+}
+
+# result <output dir>: itemsets and rules, sorted so the rank layout doesn't matter
+result() {
+    LC_ALL=C sort $1/itemsets.csv
+    LC_ALL=C sort $1/rules.csv
+}
+
+# expect_same <output dir> <output dir>
+expect_same() {
+    diff <(result $1) <(result $2) > /dev/null || fail "$1 differs from $2"
+}
+
+# expect_log <name> <pattern>: the log of the run matches pattern
+expect_log() {
+    grep -q "$2" ${JOB_PATH}/$1.log || fail "$1 log doesn't contain '$2'"
+}
+
+# expect_same_items <output dir> <output dir>: as expect_same, but the items of each itemset
+# are sorted first for runs that numbered the items in a different order
+expect_same_items() {
+    local SORT_ITEMS='import re, sys
+for line in sys.stdin:
+    print(re.sub(r"<([^>]*)>", lambda m: "<" + ":".join(sorted(m.group(1).split(":"))) + ">", line), end="")'
+    diff <(result $1 | python3 -c "${SORT_ITEMS}" | LC_ALL=C sort) \
+         <(result $2 | python3 -c "${SORT_ITEMS}" | LC_ALL=C sort) > /dev/null || fail "$1 differs from $2"
+}
@@ -0,0 +1,23 @@
+#!/bin/bash
+
+# Mines with --compress_counts on several nodes and checks that the result is identical
+# to a run without compression. The large candidate levels of sample_medium.csv have
+# mostly zero counts on each node and are sent sparse, the others in dense lanes.
+
+JOB_ID="test-compress-job"
+N_PROC=4
+PARAMS="--max_k 5 --min_sup 0.01 --min_conf 0.3"
+
+source test_common.sh
+
+run full ${N_PROC} --input sample_medium.csv ${PARAMS}
+
+for RANKS_PER_NODE in 1 2; do
+    NAME=compressed_${RANKS_PER_NODE}
+    run ${NAME} ${N_PROC} --input sample_medium.csv ${PARAMS} --ranks_per_node ${RANKS_PER_NODE} --compress_counts
+    expect_log ${NAME} "sparse counts"
+    expect_log ${NAME} "bit lanes"
+    expect_same ${JOB_PATH}/full ${JOB_PATH}/${NAME}
+done
+
+echo "OK"
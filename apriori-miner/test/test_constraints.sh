@@ -0,0 +1,95 @@
+#!/bin/bash
+
+# Mines sample_medium.csv with constraints and checks the result against the
+# unconstrained result filtered afterwards.
+
+JOB_ID="test-constraints-job"
+N_PROC=2
+CSV_FILE=sample_medium.csv
+DENSE_CSV_FILE=sample_dense.csv
+PARAMS="--max_k 4 --min_sup 0.02 --min_conf 0.3"
+DENSE_PARAMS="--max_k 11 --min_sup 0.2 --min_conf 0.99"
+DENSE_TIMEOUT=30
+
+source test_common.sh
+
+# post_filter <output dir> <constraint args...>
+# Prints the sorted itemsets and rules that satisfy the constraints. The itemsets are
+# skipped with --consequent and --max_antecedent as only the tracked ones are mined.
+post_filter() {
+    python3 - "$@" <<'PY'
+import sys
+
+path, args = sys.argv[1], sys.argv[2:]
+opts = dict(zip(args[::2], args[1::2]))
+items = lambda name: set(opts[name].split(',')) if name in opts else None
+allowed, excluded = items('--items'), items('--exclude') or set()
+required, consequents = items('--require') or set(), items('--consequent')
+min_antecedent = int(opts.get('--min_antecedent', 1))
+max_antecedent = int(opts.get('--max_antecedent', 0))
+
+def parse(field):
+    return set(field.strip()[1:-1].split(':'))
+
+def is_allowed(itemset):
+    return (allowed is None or itemset <= allowed) and not (itemset & excluded)
+
+def read(file):
+    with open(file) as f:
+        next(f)
+        return [line.rstrip('\n') for line in f]
+
+if consequents is None or max_antecedent == 0:
+    print('\n'.join(sorted(l for l in read(path + '/itemsets.csv') if is_allowed(parse(l.split(',')[0])))))
+
+rules = []
+for line in read(path + '/rules.csv'):
+    fields = line.split(',')
+    lhs, rhs = parse(fields[0]), parse(fields[1])
+    if not is_allowed(lhs | rhs) or not required <= (lhs | rhs): continue
+    if consequents is not None and not rhs <= consequents: continue
+    if len(lhs) < min_antecedent or (max_antecedent > 0 and len(lhs) > max_antecedent): continue
+    rules.append(line)
+print('\n'.join(sorted(rules)))
+PY
+}
+
+# check <name> <constraint args...>
+check() {
+    local NAME=$1
+    shift
+    run ${NAME} ${N_PROC} --input ${CSV_FILE} ${PARAMS} "$@"
+
+    local ACTUAL
+    if [[ " $* " == *" --consequent "* && " $* " == *" --max_antecedent "* ]]; then
+        ACTUAL=$(sort ${JOB_PATH}/${NAME}/rules.csv | grep -v '^Antidecent')
+    else
+        ACTUAL=$(sort ${JOB_PATH}/${NAME}/itemsets.csv | grep -v '^Itemset'; sort ${JOB_PATH}/${NAME}/rules.csv | grep -v '^Antidecent')
+    fi
+
+    diff <(post_filter ${JOB_PATH}/full "$@" | grep -v '^$') <(echo "${ACTUAL}" | grep -v '^$') > /dev/null || fail "${NAME} differs from the filtered full result"
+}
+
+run full ${N_PROC} --input ${CSV_FILE} ${PARAMS}
+
+check items --items I0,I1,I2,I3,I5,I8
+check exclude --exclude I0,I4
+check require --require I2
+check min_antecedent --min_antecedent 2
+check max_antecedent --max_antecedent 2
+check consequent --consequent I0,I1
+check tracked --consequent I0,I1 --max_antecedent 1
+check tracked_require --consequent I3,I4 --max_antecedent 2 --require I0
+check tracked_items --consequent I2 --max_antecedent 2 --min_antecedent 2 --exclude I1
+
+# Bounded antecedents must not enumerate all subsets of long itemsets
+run dense_full ${N_PROC} --input ${DENSE_CSV_FILE} ${DENSE_PARAMS}
+START=$(date +%s)
+timeout ${DENSE_TIMEOUT} mpiexec -n ${N_PROC} ./apriori_mpi --input ${DENSE_CSV_FILE} ${DENSE_PARAMS} --max_antecedent 1 \
+    --output ${JOB_PATH}/dense > ${JOB_PATH}/dense.log 2>&1 || fail "dense run failed or took over ${DENSE_TIMEOUT}s"
+echo "dense --max_antecedent 1 took $(( $(date +%s) - START ))s"
+diff <(post_filter ${JOB_PATH}/dense_full --max_antecedent 1 | grep -v '^$') \
+     <(sort ${JOB_PATH}/dense/itemsets.csv | grep -v '^Itemset'; sort ${JOB_PATH}/dense/rules.csv | grep -v '^Antidecent') > /dev/null \
+    || fail "dense differs from the filtered full result"
+
+echo "OK"
@@ -0,0 +1,27 @@
+#!/bin/bash
+
+# Mines sample_medium.csv with the SON algorithm on several process layouts and checks
+# that the result is identical to plain Apriori.
+
+JOB_ID="test-son-job"
+N_PROC=4
+CSV_FILE=sample_medium.csv
+PARAMS="--max_k 4 --min_sup 0.02 --min_conf 0.3"
+
+source test_common.sh
+
+run apriori ${N_PROC} --input ${CSV_FILE} ${PARAMS}
+
+for NP in 1 2 3 ${N_PROC}; do
+    run son_${NP} ${NP} --input ${CSV_FILE} ${PARAMS} --algorithm son
+    expect_same ${JOB_PATH}/apriori ${JOB_PATH}/son_${NP}
+done
+
+# Several nodes, the candidates are exchanged between the node leaders
+run son_nodes ${N_PROC} --input ${CSV_FILE} ${PARAMS} --algorithm son --ranks_per_node 2
+expect_same ${JOB_PATH}/apriori ${JOB_PATH}/son_nodes
+
+run son_nodes_uneven 3 --input ${CSV_FILE} ${PARAMS} --algorithm son --ranks_per_node 2
+expect_same ${JOB_PATH}/apriori ${JOB_PATH}/son_nodes_uneven
+
+echo "OK"
@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Mines sample_stream.csv, whose items drift over time, as a stream and checks that
+# every window equals a batch run on the same lines, and that the items of expired
+# panes are forgotten.
+
+JOB_ID="test-stream-job"
+N_PROC=3
+CSV_FILE=sample_stream.csv
+PARAMS="--max_k 3 --min_sup 0.05 --min_conf 0.5"
+BATCH_SIZE=50
+WINDOW=3
+
+source test_common.sh
+
+# check <name> <constraint args...>
+check() {
+    local NAME=$1
+    shift
+    run ${NAME} ${N_PROC} --stream ${CSV_FILE} --batch_size ${BATCH_SIZE} --window ${WINDOW} ${PARAMS} "$@"
+
+    local NUM_STEPS=$(( ($(wc -l < ${CSV_FILE}) + BATCH_SIZE - 1) / BATCH_SIZE ))
+    for (( STEP = 0; STEP < NUM_STEPS; ++STEP )); do
+        local LAST=$(( (STEP + 1) * BATCH_SIZE ))
+        local FIRST=$(( LAST - WINDOW * BATCH_SIZE ))
+        (( FIRST < 0 )) && FIRST=0
+
+        local SLICE=${JOB_PATH}/${NAME}_slice_${STEP}
+        sed -n "$(( FIRST + 1 )),${LAST}p" ${CSV_FILE} > ${SLICE}.csv
+        run ${NAME}_batch_${STEP} ${N_PROC} --input ${SLICE}.csv ${PARAMS} "$@"
+
+        # The stream numbers the items in the order they arrive
+        expect_same_items ${JOB_PATH}/${NAME}_batch_${STEP} ${JOB_PATH}/${NAME}/window_${STEP}
+    done
+
+    # Only the items of the last window are kept
+    local NUM_ITEMS=$(tr ',' '\n' < ${SLICE}.csv | sed 's/ //g' | grep -v '^$' | sort -u | wc -l)
+    expect_log ${NAME} "step=$(( NUM_STEPS - 1 )) .* items=${NUM_ITEMS}$"
+}
+
+check stream
+check stream_exclude --exclude C0,S20
+
+echo "OK"